@@ -1,6 +1,8 @@
 #ifndef __MUNTHER_2D_UNWRAP
 #define __MUNTHER_2D_UNWRAP
 
+#include <stddef.h>
+
 typedef unsigned char         BYTE;
 
 //PIXELM information
@@ -12,7 +14,7 @@ struct PIXELM
   int number_of_pixels_in_group;  //No. of pixel in the pixel group
   float value;                    //value of the pixel
   float reliability;
-  BYTE input_mask;                //0 pixel is masked. 255 pixel is not masked
+  BYTE input_mask;                //0 pixel is masked. nonzero pixel is not masked
   BYTE extended_mask;             //0 pixel is masked. 255 pixel is not masked
   int group;                      //group No.
   int new_group;
@@ -35,29 +37,287 @@ struct EDGE
 
 typedef struct EDGE       EDGE;  
 
+//the edge of the compact layout (see unwrap_compact.c). pixel is the index
+//of the first pixel shifted left by two (three for volumes), and the low 
+//bits tell where the second pixel is, so images must have fewer than 2^30
+//pixels and volumes fewer than 2^29 voxels (see compact_fits).
+struct COMPACT_EDGE
+{
+  float reliab;
+  unsigned int pixel;
+};
+
+typedef struct COMPACT_EDGE COMPACT_EDGE;
+
+//how the edges are sorted by reliability. BUCKET_SORT only puts them into
+//n_buckets buckets of reliability, which is faster but not exact (see
+//bucket_sort). The compact layout always sorts exactly.
+typedef enum {QUICKER_SORT, RADIX_SORT, BUCKET_SORT} SORT_METHOD;
+//how the pixels are gathered into groups. BORUVKA finds the same groups 
+//on the threads of the context, but each group may be unwrapped to a whole
+//number of 2*pi away from the other methods (see unwrap_boruvka.c).
+typedef enum {LINKED_LIST, UNION_FIND, BORUVKA} MERGE_METHOD;
+//how the pixels and edges are stored while unwrapping. SPARSE_ARRAYS only
+//keeps the unmasked pixels (see unwrap_sparse.c) and PIXELM_BLOCKS keeps
+//the PIXELMs in square blocks for the merges (see unwrap_blocks.c).
+typedef enum {PIXELM_ARRAY, COMPACT_ARRAYS, SPARSE_ARRAYS, PIXELM_BLOCKS} PIXEL_LAYOUT;
+//the type of the wrap counts of phase_unwrap_2D_counts
+typedef enum {WRAP_COUNT_INT8, WRAP_COUNT_INT16} WRAP_COUNT_TYPE;
+
+//the vector instructions used by the kernels of unwrap_simd.c
+typedef enum {SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512} SIMD_LEVEL;
+
+//what one call of phase_unwrap_2D_ctx did, filled in when the context
+//points at one. The times are wall-clock seconds of each stage.
+struct UNWRAP_STATS
+{
+  double mask_seconds;          //checking and extending (or packing) the mask
+  double reliability_seconds;   //initialisePIXELs and calculate_reliability
+  double edges_seconds;
+  double sort_seconds;
+  double merge_seconds;
+  double return_seconds;        //unwrapImage, maskImage and returnImage
+  double total_seconds;
+  long No_of_edges;
+  long No_of_merges;            //No. of times two groups were merged
+  long No_of_relinked;          //No. of pixels moved into another group
+  long No_of_groups;            //groups of unmasked pixels after merging
+  long No_of_dirty;             //pixels re-resolved by a warm frame of a stream
+};
+
+typedef struct UNWRAP_STATS UNWRAP_STATS;
+
+//the buffers of an UNWRAP_PLAN, allocated once by unwrap_plan_create and
+//reused by every call of the plan. The unwrapper allocates (and frees) any
+//buffer which is NULL, and all of them when the context has no workspace.
+struct UNWRAP_WORKSPACE
+{
+  BYTE *full_mask;                //255 everywhere, for calls with no mask
+  unsigned long long *input_bits; //the masks of the PIXELM layouts, packed
+  unsigned long long *extended_bits; //into rows of MASK_WORDS words
+  PIXELM *pixel;
+  EDGE *edge;
+  EDGE *sort_buffer;              //the buffer of radix_sort
+  float *row_reliability;         //one row for the reliability kernels
+  int *row_index;                 //two rows of block indices of the blocks layout
+  int *forest;                    //the six arrays of gatherPIXELs_boruvka
+  unsigned long long *mask_bits;  //the packed mask of the compact layout
+  int *parent;
+  int *increment;
+  COMPACT_EDGE *compact_edge;
+  float *reliability;             //the compact reliabilities when unwrapping in place
+};
+
+typedef struct UNWRAP_WORKSPACE UNWRAP_WORKSPACE;
+
+//bit index of a mask packed one bit per pixel, 1 if it is not masked
+#define MASK_BIT(mask, index) (((mask)[(index) >> 6] >> ((index) & 63)) & 1)
+//the PIXELM layouts pack the input and extended masks by rows, each row
+//starting a new word, so pixel j of a row is MASK_BIT of the row. The bits
+//past the end of a row are 0.
+#define MASK_WORDS(image_width) (((image_width) + 63) / 64)
+
+//the UNWRAP_CONTEXT holds the state that one call of the unwrapper needs.
+//Each thread unwrapping an image should use its own context, then several
+//images can be unwrapped at the same time with no shared state.
+struct UNWRAP_CONTEXT
+{
+  int x_connectivity;   //1 if the left and right borders of the image are connected
+  int y_connectivity;   //1 if the top and bottom borders of the image are connected
+  int z_connectivity;   //1 if the first and last slices of a volume are connected
+  int No_of_edges;      //No. of edges built for the current image
+  unsigned int seed;    //state of the random generator used for the reliability of masked pixels
+  SORT_METHOD sort_method;
+  int n_buckets;        //No. of buckets of BUCKET_SORT, 4096 by default
+  MERGE_METHOD merge_method;
+  PIXEL_LAYOUT layout;  //COMPACT_ARRAYS always merges with union-find
+  SIMD_LEVEL simd_level; //widest kernels to use, best_simd_level() by default
+  int n_threads;        //No. of threads for the parallel stages, <= 0 for one per CPU
+  UNWRAP_WORKSPACE *workspace; //buffers of a plan, NULL to allocate them on each call
+  UNWRAP_STATS *stats;  //filled in by each call if not NULL
+  //the reliability of each pixel (lower is more reliable), such as a
+  //coherence map computed upstream, used in place of calculate_reliability
+  //if not NULL. Every pixel takes its value, including the pixels masked
+  //by the extended mask, which otherwise get 9999999 + a random number.
+  float *quality;
+  //filled in with the reliability each pixel was unwrapped with if not
+  //NULL, unless the mask leaves nothing to unwrap. Only the PIXELM_ARRAY
+  //layout handles quality and reliability_map, so other layouts are
+  //unwrapped with it when either is set.
+  float *reliability_map;
+};
+
+typedef struct UNWRAP_CONTEXT UNWRAP_CONTEXT;
+
+//for loops which are specialised by a constant argument, such as whether
+//stats are kept
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+double unwrap_seconds(void);
+void unwrap_stats_lap(double *stage, double *start);
+//add the time since start to a stage of the stats of the context
+#define STATS_LAP(ctx, stage, start) do { \
+  if ((ctx)->stats != NULL) unwrap_stats_lap(&(ctx)->stats->stage, &(start)); \
+  } while (0)
+
+extern int x_connectivity_2D;
+extern int y_connectivity_2D;
+extern int z_connectivity_3D;
+
+void initialise_unwrap_context(UNWRAP_CONTEXT *ctx);
+//computes the reliability of n pixels of a row away from the borders
+typedef void (*RELIABILITY_ROW)(const float *up, const float *centre, 
+                                const float *down, float *reliability, int n);
+//computes the phase of n complex values stored as (real, imaginary) pairs
+typedef void (*PHASE_ROW)(const float *interferogram, float *phase, int n);
+
+//an unwrapper set up once for images of n_pe x n_fe, which reuses its
+//buffers on every call, as an FFTW plan does
+struct UNWRAP_PLAN
+{
+  UNWRAP_CONTEXT ctx;
+  UNWRAP_WORKSPACE workspace;
+  unsigned int seed;    //the seed every call starts from
+  int n_pe;
+  int n_fe;
+};
+
+typedef struct UNWRAP_PLAN UNWRAP_PLAN;
+
+UNWRAP_PLAN *unwrap_plan_create(UNWRAP_CONTEXT *ctx, int n_pe, int n_fe);
+int  phase_unwrap_2D_plan(UNWRAP_PLAN *plan, float* WrappedImage, 
+                          float* UnwrappedImage, BYTE* input_mask);
+void unwrap_plan_destroy(UNWRAP_PLAN *plan);
+
+//unwraps the frames of a stream of images of n_pe x n_fe, warm-starting
+//each frame from the one before (see unwrap_stream.c)
+struct UNWRAP_STREAM
+{
+  UNWRAP_PLAN *plan;            //unwraps the frames which are not warm-started
+  float max_change;             //pixels which move further than this from the last frame are re-resolved, pi/2 by default
+  float max_dirty;              //largest fraction of re-resolved pixels of a warm frame, 0.25 by default
+  int has_last;                 //0 if the next frame is unwrapped by the plan
+  float *last_unwrapped;
+  BYTE *last_mask;
+  int *wrap_count;              //No. of 2*pi of each pixel in the last frame
+  BYTE *dirty;
+  unsigned long long *mask_bits; //the compact layout of the warm frames
+  int *parent;
+  int *increment;
+  float *reliability;
+  COMPACT_EDGE *edge;
+  long No_of_warm;              //No. of frames warm-started
+  long No_of_cold;              //No. of frames unwrapped by the plan
+  int n_pe;
+  int n_fe;
+};
+
+typedef struct UNWRAP_STREAM UNWRAP_STREAM;
+
+UNWRAP_STREAM *unwrap_stream_create(UNWRAP_CONTEXT *ctx, int n_pe, int n_fe);
+int  phase_unwrap_2D_stream(UNWRAP_STREAM *stream, float* WrappedImage,
+                            float* UnwrappedImage, BYTE* input_mask);
+void unwrap_stream_reset(UNWRAP_STREAM *stream);
+void unwrap_stream_destroy(UNWRAP_STREAM *stream);
+int  phase_unwrap_2D_predicted(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                               float* Prediction, float* UnwrappedImage,
+                               BYTE* input_mask, int n_pe, int n_fe,
+                               float max_change, float max_dirty);
+UNWRAP_WORKSPACE *context_workspace(UNWRAP_CONTEXT *ctx);
+void *workspace_buffer(void *planned, size_t size, int zero);
+void release_buffer(void *planned, void *buffer);
+
+SIMD_LEVEL best_simd_level(void);
+RELIABILITY_ROW reliability_row_kernel(SIMD_LEVEL level);
+PHASE_ROW phase_row_kernel(SIMD_LEVEL level);
 
 int phase_unwrap_2D(float* WrappedImage, float* UnwrappedImage, 
                     BYTE* input_mask, int n_pe, int n_fe);  
+int phase_unwrap_2D_ctx(UNWRAP_CONTEXT *ctx, float* WrappedImage, 
+                        float* UnwrappedImage, BYTE* input_mask, int n_pe, 
+                        int n_fe);
+int phase_unwrap_2D_counts(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                           void* WrapCounts, WRAP_COUNT_TYPE count_type,
+                           BYTE* input_mask, int n_pe, int n_fe);
+size_t wrap_count_size(WRAP_COUNT_TYPE count_type);
+int phase_unwrap_2D_double(UNWRAP_CONTEXT *ctx, double* WrappedImage,
+                           double* UnwrappedImage, BYTE* input_mask,
+                           int n_pe, int n_fe);
+int phase_unwrap_2D_mixed(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                          double* UnwrappedImage, BYTE* input_mask,
+                          int n_pe, int n_fe);
+int phase_unwrap_2D_complex(UNWRAP_CONTEXT *ctx, float* Interferogram,
+                            float* UnwrappedImage, BYTE* input_mask,
+                            int n_pe, int n_fe);
+int phase_unwrap_2D_complex_double(UNWRAP_CONTEXT *ctx, double* Interferogram,
+                                   double* UnwrappedImage, BYTE* input_mask,
+                                   int n_pe, int n_fe);
+int phase_unwrap_2D_pyramid(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                            float* UnwrappedImage, BYTE* input_mask,
+                            int n_pe, int n_fe, int levels);
+int phase_unwrap_2D_compact(UNWRAP_CONTEXT *ctx, float* WrappedImage, 
+                            float* UnwrappedImage, BYTE* input_mask, 
+                            int n_pe, int n_fe);
+int phase_unwrap_2D_compact_labels(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                                   float* UnwrappedImage, BYTE* input_mask,
+                                   int n_pe, int n_fe, int *label);
+size_t unwrap_workspace_size(UNWRAP_CONTEXT *ctx, int n_pe, int n_fe, 
+                             int in_place);
+int isSaneMask(BYTE* input_mask, int n_pe, int n_fe);
+size_t compact_workspace_size(int n_pe, int n_fe, int in_place);
+int compact_fits(size_t image_size, int kind_bits);
+int phase_unwrap_2D_sparse(UNWRAP_CONTEXT *ctx, float* WrappedImage, 
+                           float* UnwrappedImage, BYTE* input_mask, 
+                           int n_pe, int n_fe);
+size_t sparse_workspace_size(UNWRAP_CONTEXT *ctx, int n_pe, int n_fe,
+                             int No_of_pixels);
+int phase_unwrap_2D_blocks(UNWRAP_CONTEXT *ctx, float* WrappedImage, 
+                           float* UnwrappedImage, BYTE* input_mask, 
+                           int n_pe, int n_fe);
+void compact_sort(COMPACT_EDGE *edge, int No_of_edges, int kind_bits);
+int phase_unwrap_2D_stack(float* WrappedImage, float* UnwrappedImage, 
+                          BYTE* input_mask, int mask_stride, int n_slices, 
+                          int n_pe, int n_fe, int n_threads);
 
 typedef enum {yes, no} yes_no;
 yes_no find_pivot(EDGE *left, EDGE *right, float *pivot_ptr);
 
 EDGE *partition(EDGE *left, EDGE *right, float pivot);
 void quicker_sort(EDGE *left, EDGE *right);
-void  initialisePIXELs(float *WrappedImage, BYTE *input_mask, 
-                       BYTE *extended_mask, PIXELM *pixel, int image_width, 
-                       int image_height);
+void radix_sort(EDGE *edge, EDGE *buffer, int No_of_edges, int n_threads);
+int  bucket_sort(EDGE *edge, EDGE *buffer, int No_of_edges, int n_buckets,
+                 int n_threads);
+void  sortEDGEs(UNWRAP_CONTEXT *ctx, EDGE *edge, int No_of_edges);
+int   initialisePIXELs(UNWRAP_CONTEXT *ctx, float *WrappedImage, 
+                       BYTE *input_mask, BYTE *extended_mask, PIXELM *pixel, 
+                       int image_width, int image_height);
 float wrap(float pixel_value);
 int find_wrap(float pixelL_value, float pixelR_value);
-void extend_mask(BYTE *input_mask, BYTE *extended_mask, int image_width, 
-                 int image_height);
-void calculate_reliability(float *wrappedImage, PIXELM *pixel, int image_width,
-                           int image_height);
-void  horizentalEDGEs(PIXELM *pixel, EDGE *edge, int image_width, 
+int  extend_mask(UNWRAP_CONTEXT *ctx, BYTE *input_mask, BYTE *extended_mask, 
+                 int image_width, int image_height);
+void pack_mask(BYTE *input_mask, unsigned long long *mask_bits, 
+               int image_width, int image_height);
+void extend_mask_bits(UNWRAP_CONTEXT *ctx, unsigned long long *input_bits,
+                      unsigned long long *extended_bits, int image_width,
                       int image_height);
-void  verticalEDGEs(PIXELM *pixel, EDGE *edge, int image_width, 
-                    int image_height);
-void  gatherPIXELs(EDGE *edge, int image_width, int image_height);
+int  calculate_reliability(UNWRAP_CONTEXT *ctx, float *wrappedImage, 
+                           PIXELM *pixel, int image_width, int image_height);
+int   horizentalEDGEs(UNWRAP_CONTEXT *ctx, PIXELM *pixel, EDGE *edge, 
+                      int image_width, int image_height);
+int   verticalEDGEs(UNWRAP_CONTEXT *ctx, PIXELM *pixel, EDGE *edge, 
+                    int image_width, int image_height);
+void  gatherPIXELs(UNWRAP_CONTEXT *ctx, EDGE *edge, int image_width, 
+                   int image_height);
+void  gatherPIXELs_union_find(UNWRAP_CONTEXT *ctx, PIXELM *pixel, EDGE *edge,
+                              int image_width, int image_height);
+int   gatherPIXELs_boruvka(UNWRAP_CONTEXT *ctx, PIXELM *pixel, EDGE *edge,
+                           int image_width, int image_height);
+void  mergePIXELs(UNWRAP_CONTEXT *ctx, PIXELM *pixel, EDGE *edge,
+                  int image_width, int image_height);
 void  unwrapImage(PIXELM *pixel, int image_width, int image_height);
 void  maskImage(PIXELM *pixel, BYTE *input_mask, int image_width, 
                 int image_height);
@@ -0,0 +1,350 @@
+//Three-dimensional unwrapper built on the same reliability sorting as the
+//two-dimensional one, after "Fast three-dimensional phase-unwrapping
+//algorithm based on sorting by reliability following a non-continuous
+//path" by Hussein Abdul-Rahman, Munther Gdeisat, David Burton and Michael
+//Lalor, published in Proc. SPIE 5856, 2005.
+//
+//The reliability of a voxel is the sum of the squares of the second
+//differences through it in the 13 directions to its 26 neighbours, which
+//needs the voxel and its 26 neighbours to be unmasked. Every other voxel
+//gets a random reliability as in the 2D unwrapper, and so does every voxel
+//on the borders of two axes, as the corners of a 2D image do: with
+//wraparound its second differences would cross two seams, where a surface
+//which is not periodic jumps, and could make the seam edges look
+//reliable. The eight corners of the volume, whose neighbours are all on
+//two borders, get a reliability worse than any random one, so that the
+//seam edges between corners come after the edges which join the corners
+//to the rest of the volume. An axis of one voxel has no borders.
+//
+//Edges join each voxel to its next neighbour along each of the three axes, and each axis can
+//wrap around on its own (ctx->x_connectivity, y_connectivity and
+//z_connectivity).
+//
+//The voxels and edges are kept in the compact layout of unwrap_compact.c,
+//which is about 32 bytes per voxel, and are sorted and merged by the same
+//code as the 2D compact layout. The prototype is
+//
+//   int phase_unwrap_3D_ctx(UNWRAP_CONTEXT *ctx, float* WrappedVolume,
+//                           float* UnwrappedVolume, BYTE* input_mask,
+//                           int volume_depth, int volume_height,
+//                           int volume_width)
+//
+//where the volumes are stored with the width varying fastest and the mask
+//is nonzero (255) at good voxels and 0 at bad ones. Volumes of more
+//voxels than the compact edges can index (see compact_fits) are not
+//unwrapped: the wrapped volume is copied and 0 returned.
+
+#include "Munther_3D_unwrap.h"
+#include "unwrap_compact.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//the kinds of edge, by where the second voxel is, in the order
+//volume_edges builds them
+#define X_NEIGHBOUR   0
+#define X_WRAPAROUND  1
+#define Y_NEIGHBOUR   2
+#define Y_WRAPAROUND  3
+#define Z_NEIGHBOUR   4
+#define Z_WRAPAROUND  5
+
+//the reliability of the corners of the volume, worse than 9999999 plus any
+//rand_r
+#define CORNER_RELIABILITY 4.0e9f
+
+//one direction of each pair of opposite neighbours
+static const int direction[13][3] =
+{
+  {0, 0, 1}, {0, 1, 0}, {1, 0, 0},
+  {0, 1, 1}, {0, 1, -1}, {1, 0, 1}, {1, 0, -1}, {1, 1, 0}, {1, -1, 0},
+  {1, 1, 1}, {1, 1, -1}, {1, -1, 1}, {1, -1, -1}
+};
+
+struct VOLUME
+{
+  int depth;
+  int height;
+  int width;
+};
+
+typedef struct VOLUME VOLUME;
+
+//the index of the neighbour of voxel (z, y, x) at (z+dz, y+dy, x+dx),
+//wrapping around every axis
+static int neighbour_index(VOLUME *volume, int z, int y, int x, int dz,
+                           int dy, int dx)
+{
+  z += dz;
+  y += dy;
+  x += dx;
+  if (z < 0) z += volume->depth; else if (z >= volume->depth) z -= volume->depth;
+  if (y < 0) y += volume->height; else if (y >= volume->height) y -= volume->height;
+  if (x < 0) x += volume->width; else if (x >= volume->width) x -= volume->width;
+  return (z * volume->height + y) * volume->width + x;
+}
+
+//1 if coordinate is on a border of an axis longer than one voxel
+static int on_border(int coordinate, int size)
+{
+  return size > 1 && (coordinate == 0 || coordinate == size - 1);
+}
+
+static void volume_reliability(UNWRAP_CONTEXT *ctx, COMPACT *compact,
+                               VOLUME *volume)
+{
+  float *value = compact->value;
+  int offset[13][2];          //index offsets of the two neighbours, inside
+  int z, y, x, d, index, interior, usable, minus, plus;
+  int z_border, y_border, x_border, borders;
+  float centre, D, reliability;
+
+  for (index = 0; index < compact->image_size; index++)
+    compact->reliability[index] = (float) (9999999.0 + rand_r(&ctx->seed));
+
+  for (d = 0; d < 13; d++)
+  {
+    offset[d][1] = (direction[d][0] * volume->height + direction[d][1]) *
+                   volume->width + direction[d][2];
+    offset[d][0] = -offset[d][1];
+  }
+
+  for (z = 0; z < volume->depth; z++)
+  {
+    z_border = on_border(z, volume->depth);
+    for (y = 0; y < volume->height; y++)
+    {
+      y_border = on_border(y, volume->height);
+      for (x = 0; x < volume->width; x++)
+      {
+        x_border = on_border(x, volume->width);
+        borders = z_border + y_border + x_border;
+        index = (z * volume->height + y) * volume->width + x;
+        if (borders == 3)
+          compact->reliability[index] = CORNER_RELIABILITY;
+        if (borders > 1 || (z_border && !ctx->z_connectivity) ||
+            (y_border && !ctx->y_connectivity) ||
+            (x_border && !ctx->x_connectivity))
+          continue;
+        interior = z > 0 && z < volume->depth - 1 && y > 0 &&
+                   y < volume->height - 1 && x > 0 && x < volume->width - 1;
+
+        usable = MASK_BIT(compact->mask, index);
+        for (d = 0; d < 13 && usable; d++)
+        {
+          if (interior)
+          {
+            minus = index + offset[d][0];
+            plus = index + offset[d][1];
+          }
+          else
+          {
+            minus = neighbour_index(volume, z, y, x, -direction[d][0],
+                                    -direction[d][1], -direction[d][2]);
+            plus = neighbour_index(volume, z, y, x, direction[d][0],
+                                   direction[d][1], direction[d][2]);
+          }
+          usable = MASK_BIT(compact->mask, minus) &&
+                   MASK_BIT(compact->mask, plus);
+        }
+        if (!usable) continue;
+
+        centre = value[index];
+        reliability = 0;
+        for (d = 0; d < 13; d++)
+        {
+          if (interior)
+          {
+            minus = index + offset[d][0];
+            plus = index + offset[d][1];
+          }
+          else
+          {
+            minus = neighbour_index(volume, z, y, x, -direction[d][0],
+                                    -direction[d][1], -direction[d][2]);
+            plus = neighbour_index(volume, z, y, x, direction[d][0],
+                                   direction[d][1], direction[d][2]);
+          }
+          D = wrap(value[minus] - centre) - wrap(centre - value[plus]);
+          reliability += D*D;
+        }
+        compact->reliability[index] = reliability;
+      }
+    }
+  }
+}
+
+static void volume_edges(UNWRAP_CONTEXT *ctx, COMPACT *compact,
+                         VOLUME *volume)
+{
+  int z, y, x, slice = volume->height * volume->width;
+
+  compact->No_of_edges = 0;
+  for (z = 0; z < volume->depth; z++)
+    for (y = 0; y < volume->height; y++)
+      for (x = 0; x < volume->width - 1; x++)
+        compact_add_edge(compact, z * slice + y * volume->width + x,
+                         X_NEIGHBOUR);
+  if (ctx->x_connectivity == 1)
+    for (z = 0; z < volume->depth; z++)
+      for (y = 0; y < volume->height; y++)
+        compact_add_edge(compact, z * slice + y * volume->width +
+                         volume->width - 1, X_WRAPAROUND);
+  for (z = 0; z < volume->depth; z++)
+    for (y = 0; y < volume->height - 1; y++)
+      for (x = 0; x < volume->width; x++)
+        compact_add_edge(compact, z * slice + y * volume->width + x,
+                         Y_NEIGHBOUR);
+  if (ctx->y_connectivity == 1)
+    for (z = 0; z < volume->depth; z++)
+      for (x = 0; x < volume->width; x++)
+        compact_add_edge(compact, z * slice +
+                         (volume->height - 1) * volume->width + x,
+                         Y_WRAPAROUND);
+  for (z = 0; z < volume->depth - 1; z++)
+    for (y = 0; y < slice; y++)
+      compact_add_edge(compact, z * slice + y, Z_NEIGHBOUR);
+  if (ctx->z_connectivity == 1)
+    for (y = 0; y < slice; y++)
+      compact_add_edge(compact, (volume->depth - 1) * slice + y,
+                       Z_WRAPAROUND);
+  ctx->No_of_edges = compact->No_of_edges;
+}
+
+//as isSaneMask: unwrapping needs two neighbouring voxels which are not
+//masked
+int isSaneMask3D(BYTE* input_mask, int volume_depth, int volume_height,
+                 int volume_width)
+{
+  int z, y, x, index;
+  int slice = volume_height * volume_width;
+
+  for (z = 0; z < volume_depth; z++)
+  {
+    for (y = 0; y < volume_height; y++)
+    {
+      for (x = 0; x < volume_width; x++)
+      {
+        index = z * slice + y * volume_width + x;
+        if (input_mask[index] == 0) continue;
+        if (x < volume_width - 1 && input_mask[index + 1] != 0) return 1;
+        if (y < volume_height - 1 && input_mask[index + volume_width] != 0)
+          return 1;
+        if (z < volume_depth - 1 && input_mask[index + slice] != 0)
+          return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+//No. of bytes phase_unwrap_3D_ctx allocates for a volume
+size_t unwrap_3D_workspace_size(int volume_depth, int volume_height,
+                                int volume_width, int in_place)
+{
+  size_t volume_size = (size_t) volume_depth * volume_height * volume_width;
+  size_t size = ((volume_size + 63) / 64) * sizeof(unsigned long long) +
+                2 * volume_size * sizeof(int) +
+                3 * volume_size * sizeof(COMPACT_EDGE);
+  if (in_place) size += volume_size * sizeof(float);
+  return size;
+}
+
+int phase_unwrap_3D_ctx(UNWRAP_CONTEXT *ctx, float* WrappedVolume,
+                        float* UnwrappedVolume, BYTE* input_mask,
+                        int volume_depth, int volume_height, int volume_width)
+{
+  COMPACT compact;
+  VOLUME volume;
+  BYTE *own_mask = NULL;
+  float *own_reliability = NULL;
+  int volume_size = volume_depth * volume_height * volume_width;
+  int slice = volume_height * volume_width;
+  int i, sane;
+
+  if (input_mask == NULL)
+  {
+    own_mask = (BYTE *) malloc(volume_size * sizeof(BYTE));
+    if (own_mask != NULL) memset(own_mask, 255, volume_size);
+    input_mask = own_mask;
+  }
+  sane = input_mask != NULL &&
+         compact_fits((size_t) volume_depth * volume_height * volume_width,
+                      3) &&
+         isSaneMask3D(input_mask, volume_depth, volume_height, volume_width);
+
+  volume.depth = volume_depth;
+  volume.height = volume_height;
+  volume.width = volume_width;
+  compact.value = WrappedVolume;
+  compact.image_size = volume_size;
+  compact.image_width = volume_width;
+  compact.image_height = volume_height;
+  compact.kind_bits = 3;
+  compact.neighbour[X_NEIGHBOUR] = 1;
+  compact.neighbour[Y_NEIGHBOUR] = volume_width;
+  compact.neighbour[Z_NEIGHBOUR] = slice;
+  compact.neighbour[X_WRAPAROUND] = 1 - volume_width;
+  compact.neighbour[Y_WRAPAROUND] = -volume_width * (volume_height - 1);
+  compact.neighbour[Z_WRAPAROUND] = -slice * (volume_depth - 1);
+  compact.edge = NULL;
+  compact.increment = NULL;
+  compact.parent = NULL;
+  compact.mask = NULL;
+  compact.stats = NULL;
+
+  if (sane)
+  {
+    //the unwrapped volume holds the reliabilities, unless it is the
+    //wrapped volume
+    if (UnwrappedVolume == WrappedVolume)
+      own_reliability = (float *) malloc(volume_size * sizeof(float));
+    compact.reliability = own_reliability ? own_reliability : UnwrappedVolume;
+    compact.mask = (unsigned long long *)
+      malloc(((volume_size + 63) / 64) * sizeof(unsigned long long));
+    compact.parent = (int *) malloc(volume_size * sizeof(int));
+    compact.increment = (int *) malloc(volume_size * sizeof(int));
+    compact.edge = (COMPACT_EDGE *)
+      malloc(3 * (size_t) volume_size * sizeof(COMPACT_EDGE));
+    sane = !(UnwrappedVolume == WrappedVolume && own_reliability == NULL) &&
+           compact.mask != NULL && compact.parent != NULL &&
+           compact.increment != NULL && compact.edge != NULL;
+  }
+
+  if (sane)
+  {
+    compact_pack_mask(&compact, input_mask);
+    volume_reliability(ctx, &compact, &volume);
+    volume_edges(ctx, &compact, &volume);
+    compact_sort(compact.edge, compact.No_of_edges, compact.kind_bits);
+    for (i = 0; i < volume_size; i++)
+    {
+      compact.parent[i] = -1;
+      compact.increment[i] = 0;
+    }
+    compact_gather(&compact);
+    compact_return(&compact, UnwrappedVolume);
+  }
+  else
+  {
+    memmove(UnwrappedVolume, WrappedVolume, volume_size * sizeof(float));
+  }
+
+  free(compact.edge);
+  free(compact.increment);
+  free(compact.parent);
+  free(compact.mask);
+  free(own_reliability);
+  free(own_mask);
+  return sane;
+}
+
+int phase_unwrap_3D(float* WrappedVolume, float* UnwrappedVolume,
+                    BYTE* input_mask, int volume_depth, int volume_height,
+                    int volume_width)
+{
+  UNWRAP_CONTEXT ctx;
+  initialise_unwrap_context(&ctx);
+  return phase_unwrap_3D_ctx(&ctx, WrappedVolume, UnwrappedVolume, input_mask,
+                             volume_depth, volume_height, volume_width);
+}
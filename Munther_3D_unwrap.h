@@ -0,0 +1,17 @@
+#ifndef __MUNTHER_3D_UNWRAP
+#define __MUNTHER_3D_UNWRAP
+
+#include "Munther_2D_unwrap.h"
+
+int phase_unwrap_3D(float* WrappedVolume, float* UnwrappedVolume, 
+                    BYTE* input_mask, int volume_depth, int volume_height, 
+                    int volume_width);
+int phase_unwrap_3D_ctx(UNWRAP_CONTEXT *ctx, float* WrappedVolume, 
+                        float* UnwrappedVolume, BYTE* input_mask, 
+                        int volume_depth, int volume_height, int volume_width);
+int isSaneMask3D(BYTE* input_mask, int volume_depth, int volume_height, 
+                 int volume_width);
+size_t unwrap_3D_workspace_size(int volume_depth, int volume_height, 
+                                int volume_width, int in_place);
+
+#endif
@@ -1,62 +1,348 @@
 #try:
-#    from _punwrap2D import Unwrap2D
-from _punwrap2D import Unwrap2D
-    #from _punwrap3D import Unwrap3D
+#    from _punwrap2D import Unwrap2D, Unwrap2DStack
+from _punwrap2D import Unwrap2D, Unwrap2DStack, Unwrap3D, Unwrap2DTiled, \
+     Unwrap2DPlanCreate, Unwrap2DPlan, Unwrap2DStreamCreate, Unwrap2DStream, \
+     Unwrap2DPyramid
 #except ImportError:
 #   
 #    raise ImportError("Please compile the C extensions to use this module")
 
 import numpy as N
 
-def unwrap2D(matrix, mask=None):
+def _wrap_flags(wrap_around, ndim):
+    """the wraparound flags of Unwrap2D and the plans, as a tuple of ints"""
+    if len(wrap_around) != ndim:
+        raise ValueError("wrap_around should have %d flags" % ndim)
+    return tuple([int(bool(w)) for w in wrap_around])
+
+def unwrap2D(matrix, mask=None, out=None, stats=None, buckets=0,
+             wrap_around=None, quality=None, reliability=None):
     """
     The method for this module unwraps a 2D grid of wrapped phases
     using the quality-map unwrapper.
     @param matrix, if ndim > 2, explode; if ndim < 2, a 1xN matrix
-    is used. Numerical range should be [-pi,pi]
-    @return: the unwrapped phases
+    is used. Numerical range should be [-pi,pi]. A C-contiguous
+    float32 or float64 matrix is used without a copy, and float64 is
+    unwrapped into float64 without rounding its wrapped phases. A
+    complex64 or complex128 matrix (e.g. an interferogram) is also used
+    without a copy, and its phase is unwrapped into float32 or float64
+    @param mask, the points to unwrap; a bool or uint8 mask (nonzero at
+    the points to unwrap) of the same shape is used without a copy
+    @param out, an optional C-contiguous array of the same shape to
+    write the unwrapped phases into, of the dtype of matrix (float32 or
+    float64 for a complex matrix); a float64 out for a float32 matrix
+    adds the whole cycles in double precision, and an int8 or int16 out
+    gets the whole cycles themselves (see unwrap2Dcounts)
+    @param stats, an optional dict which is filled with the seconds
+    taken by each stage ('mask_seconds', ..., 'total_seconds') and the
+    numbers of 'edges', 'merges', 'relinked' pixels and 'groups'
+    @param buckets, 0 to sort the edges by reliability exactly, or the
+    number of buckets of reliability (e.g. 4096) to sort them into
+    instead, which is faster but may leave pixels near residues a
+    multiple of 2*pi away from the exact result; the fewer the buckets,
+    the more of them
+    @param wrap_around, a tuple of 2 booleans telling which axes wrap
+    around; both of them do by default
+    @param quality, an optional map of the same shape of the reliability
+    of each point, lower being more reliable (e.g. 1 - coherence), to
+    unwrap in the order of instead of the second differences of the
+    phases
+    @param reliability, an optional C-contiguous float32 array of the
+    same shape to fill with the reliability each point was unwrapped
+    with; the unwrap is then done with the PIXELM layout
+    @return: the unwrapped phases, out if it is given
     """
 
     dtype = matrix.dtype
     dims = matrix.shape
 
     if len(dims)>2: raise ValueError("matrix has too many dimensions to unwrap")
+    if dtype in (N.float64, N.complex64, N.complex128):
+        phase = N.ascontiguousarray(matrix)
+    else:
+        phase = N.ascontiguousarray(matrix, N.float32)
     if len(dims) < 2:
-        matrix.shape = (1,dims[0])
+        phase = phase.reshape((1,dims[0]))
+
+    if mask is not None:
+        if mask.shape != dims:
+            raise ValueError("mask dimensions do not match matrix dimensions!")
+        if mask.dtype != N.bool_ and mask.dtype != N.uint8:
+            mask = mask != 0
+        mask = N.ascontiguousarray(mask).reshape(phase.shape)
+
+    args = (stats, buckets)
+    if wrap_around is not None:
+        args += (_wrap_flags(wrap_around, 2),)
+    if quality is not None or reliability is not None:
+        if wrap_around is None:
+            args += ((-1, -1),)
+        if quality is not None:
+            if quality.shape != dims:
+                raise ValueError("quality dimensions do not match matrix "
+                                 "dimensions!")
+            quality = N.ascontiguousarray(quality, N.float32)
+            quality = quality.reshape(phase.shape)
+        if reliability is not None:
+            if reliability.shape != dims or \
+               reliability.dtype != N.float32 or \
+               not reliability.flags.c_contiguous:
+                raise ValueError("reliability should be a C-contiguous "
+                                 "float32 array of the shape of matrix")
+            reliability = reliability.reshape(phase.shape)
+        args += (quality, reliability)
+
+    if out is not None:
+        if out.shape != dims:
+            raise ValueError("out dimensions do not match matrix dimensions!")
+        if phase.dtype == N.float32:
+            dtypes = (N.float32, N.float64, N.int8, N.int16)
+        else:
+            dtypes = (phase.real.dtype,)
+        if out.dtype not in dtypes or not out.flags.c_contiguous:
+            raise ValueError("out should be a C-contiguous array of one of "
+                             "the dtypes %s" % (dtypes,))
+        Unwrap2D(phase, mask, out.reshape(phase.shape), *args)
+        return out
+
+    ret = Unwrap2D(phase, mask, None, *args)
+    if dtype != phase.dtype:
+        ret = ret.astype(dtype)
+    ret.shape = dims
+    return ret
+
+def unwrap2Dcounts(matrix, mask=None, dtype=N.int16, out=None,
+                   wrap_around=None):
+    """
+    Unwraps a 2D grid of wrapped phases as unwrap2D does, but returns
+    the number of whole cycles (of 2*pi) to add to each point instead
+    of the unwrapped phases, which is a half or a quarter of the bytes
+    when the caller keeps the wrapped phases anyway. The masked points
+    are 0 and counts past the range of dtype are clipped to it.
+    @param matrix, as for unwrap2D; it is unwrapped as float32, and
+    the phase of a complex matrix is taken first
+    @param mask, as for unwrap2D
+    @param dtype, N.int8 or N.int16
+    @param out, an optional C-contiguous array of dtype of the same shape
+    to write the counts into
+    @param wrap_around, as for unwrap2D
+    @return: the counts, out if it is given
+    """
+
+    dtype = N.dtype(dtype)
+    if dtype != N.int8 and dtype != N.int16:
+        raise ValueError("dtype should be int8 or int16")
+    if out is None:
+        out = N.empty(matrix.shape, dtype)
+    elif out.dtype != dtype:
+        raise ValueError("out should be of dtype")
+    if N.iscomplexobj(matrix):
+        matrix = N.angle(matrix)
+    return unwrap2D(N.asarray(matrix, N.float32), mask, out=out,
+                    wrap_around=wrap_around)
+
+def unwrap2Dpyramid(matrix, mask=None, out=None, stats=None, levels=-1,
+                    wrap_around=None):
+    """
+    Unwraps a large 2D grid of wrapped phases coarse to fine: a pyramid
+    of halved grids is unwrapped from the coarsest one up, and at each
+    finer grid only the points whose wraps the grid above does not
+    predict are unwrapped again, which is much faster for smooth
+    surfaces. Where neighbouring points differ by less than pi, as on a
+    smooth noiseless surface, the result is that of unwrap2D up to a
+    whole number of cycles; on noisy data it can differ from it by whole
+    cycles in places.
+    @param matrix, as for unwrap2D; it is unwrapped as float32, and the
+    phase of a complex matrix is taken first
+    @param mask, as for unwrap2D
+    @param out, an optional C-contiguous float32 array of the same shape
+    to write the unwrapped phases into
+    @param stats, an optional dict to fill in as for unwrap2D, for the
+    finest grid, with also 'dirty', its No. of points unwrapped again
+    @param levels, the No. of halved grids, chosen from the size if -1;
+    0 is unwrap2D
+    @param wrap_around, as for unwrap2D
+    @return: the unwrapped phases, out if it is given
+    """
+
+    if N.iscomplexobj(matrix):
+        matrix = N.angle(matrix)
+    dims = matrix.shape
+    phase = N.ascontiguousarray(matrix, N.float32)
+    if len(dims) == 1:
+        phase = phase.reshape((1,dims[0]))
+
+    if mask is not None:
+        if mask.shape != dims:
+            raise ValueError("mask dimensions do not match matrix dimensions!")
+        if mask.dtype != N.bool_ and mask.dtype != N.uint8:
+            mask = mask != 0
+        mask = N.ascontiguousarray(mask).reshape(phase.shape)
+
+    if out is None:
+        out = N.empty(dims, N.float32)
+    elif out.shape != dims or out.dtype != N.float32 or \
+         not out.flags.c_contiguous:
+        raise ValueError("out should be a C-contiguous float32 array of "
+                         "the shape of matrix")
+
+    args = (stats, levels)
+    if wrap_around is not None:
+        args += (_wrap_flags(wrap_around, 2),)
+    Unwrap2DPyramid(phase, mask, out.reshape(phase.shape), *args)
+    return out
+
+def unwrap2Dstack(matrix, mask=None, nthreads=0):
+    """
+    Unwraps every slice of a stack of independent 2D grids of wrapped
+    phases, on a pool of threads inside the C library.
+    @param matrix, an (N,H,W) array. Numerical range should be [-pi,pi]
+    @param mask, either (N,H,W) or a single (H,W) mask for every slice
+    @param nthreads, the number of threads to use; 0 uses one per CPU
+    @return: the unwrapped phases
+    """
+
+    dtype = matrix.dtype
+    dims = matrix.shape
+
+    if len(dims) != 3:
+        raise ValueError("matrix should be a (N,H,W) stack of 2D grids")
 
     if mask is None:
-        mask = 255*(N.ones(matrix.shape, N.uint8))
+        mask = 255*(N.ones(dims[1:], N.uint8))
     else:
         mask = N.where(mask, 255, 0).astype(N.uint8)
-    if dims != mask.shape:
+    if mask.shape != dims and mask.shape != dims[1:]:
         raise ValueError("mask dimensions do not match matrix dimensions!")
 
-    ret = Unwrap2D(matrix.astype(N.float32), mask).astype(dtype)
-    ret.shape = dims
-    return ret
+    return Unwrap2DStack(matrix.astype(N.float32), mask, nthreads).astype(dtype)
 
-# def unwrap3D(matrix):
-#     """
-#     The method for this module unwraps a 3D array of wrapped phases
-#     using the lp-norm method.
-#     @param matrix, if ndim > 3, explode; if ndim < 2, a 1xN matrix
-#     is used. Numerical range should be [-pi,pi]
-#     @return: the unwrapped phases
-#     """
+class UnwrapPlan(object):
+    """
+    An unwrapper set up once for 2D grids of one shape, which keeps its
+    buffers for every grid, so that unwrapping a stream of grids of
+    that shape allocates no memory. A plan unwraps one grid at a time:
+    calling it while another thread is using it raises RuntimeError.
+    @param shape, the (rows, columns) of the grids
+    @param wrap_around, a tuple of 2 booleans telling which axes wrap
+    around; both of them do by default
+    """
 
-#     dtype = matrix.dtype
-#     dims = matrix.shape
+    def __init__(self, shape, wrap_around=None):
+        self.shape = tuple(shape)
+        if wrap_around is None:
+            self._plan = Unwrap2DPlanCreate(self.shape)
+        else:
+            self._plan = Unwrap2DPlanCreate(self.shape,
+                                            _wrap_flags(wrap_around, 2))
 
-#     if len(dims)>3:
-#         raise ValueError("matrix has too many dimensions to unwrap")
-#     if len(dims) < 3:
-#         dims = (1,)*(3-len(dims)) + dims
+    def __call__(self, matrix, out, mask=None):
+        """
+        Unwraps a grid of wrapped phases into out, without copies.
+        @param matrix, a C-contiguous float32 array of the plan's shape.
+        Numerical range should be [-pi,pi]
+        @param out, a C-contiguous float32 array of the same shape
+        @param mask, None or a C-contiguous bool or uint8 array of the
+        same shape, nonzero at the points to unwrap
+        @return: out
+        """
 
-#     in_phase = N.reshape(matrix, dims).astype(N.float32)
-    
-#     # actually this seems better pre-masked (confirm??)
-#     ret = Unwrap3D(in_phase).astype(dtype)
-#     return N.reshape(ret, matrix.shape)
+        Unwrap2DPlan(self._plan, matrix, mask, out)
+        return out
+
+class UnwrapStream(object):
+    """
+    An unwrapper for a sequence of 2D grids of one shape which change
+    little from one grid to the next, such as the frames of dynamic
+    interferometry. Each grid is unwrapped from the grid before, and only
+    the points whose wraps changed are unwrapped again, so the result
+    stays continuous with the grids before. The first grid, and any grid
+    with another mask, is unwrapped in full. A stream unwraps one grid
+    at a time: calling it while another thread is using it raises
+    RuntimeError.
+    @param shape, the (rows, columns) of the grids
+    @param wrap_around, a tuple of 2 booleans telling which axes wrap
+    around; both of them do by default
+    """
+
+    def __init__(self, shape, wrap_around=None):
+        self.shape = tuple(shape)
+        if wrap_around is None:
+            self._stream = Unwrap2DStreamCreate(self.shape)
+        else:
+            self._stream = Unwrap2DStreamCreate(self.shape,
+                                                _wrap_flags(wrap_around, 2))
+        self.dirty = -1
+
+    def __call__(self, matrix, out, mask=None):
+        """
+        Unwraps the next grid of wrapped phases into out, without copies.
+        self.dirty is then the No. of points which were unwrapped again, or
+        -1 if the grid was unwrapped in full.
+        @param matrix, a C-contiguous float32 array of the stream's shape.
+        Numerical range should be [-pi,pi]
+        @param out, a C-contiguous float32 array of the same shape
+        @param mask, None or a C-contiguous bool or uint8 array of the
+        same shape, nonzero at the points to unwrap
+        @return: out
+        """
+
+        self.dirty = Unwrap2DStream(self._stream, matrix, mask, out)
+        return out
+
+def unwrap3D(matrix, mask=None, wrap_around=None):
+    """
+    The method for this module unwraps a 3D array of wrapped phases
+    using the quality-map unwrapper, with voxels and edges along all
+    three axes.
+    @param matrix, if ndim > 3, explode; if ndim < 3, a 1xN or 1x1xN
+    volume is used. Numerical range should be [-pi,pi]
+    @param mask, the voxels to unwrap, of the same shape as matrix
+    @param wrap_around, a tuple of 3 booleans telling which axes wrap
+    around; all of them do by default
+    @return: the unwrapped phases
+    """
+
+    dtype = matrix.dtype
+    dims = matrix.shape
+
+    if len(dims)>3:
+        raise ValueError("matrix has too many dimensions to unwrap")
+    in_phase = N.reshape(matrix, (1,)*(3-len(dims)) + dims)
+
+    if mask is None:
+        mask = 255*(N.ones(in_phase.shape, N.uint8))
+    else:
+        if mask.shape != dims:
+            raise ValueError("mask dimensions do not match matrix dimensions!")
+        mask = N.reshape(N.where(mask, 255, 0).astype(N.uint8), in_phase.shape)
+
+    if wrap_around is None:
+        ret = Unwrap3D(in_phase.astype(N.float32), mask)
+    else:
+        ret = Unwrap3D(in_phase.astype(N.float32), mask,
+                       tuple([int(bool(w)) for w in wrap_around]))
+    return N.reshape(ret.astype(dtype), dims)
+
+def unwrap2Dtiled(wrapped_file, unwrapped_file, shape, mask_file=None,
+                  tile_size=1024, nthreads=0):
+    """
+    Unwraps a 2D grid of wrapped phases too large for memory, tile by
+    tile. The files are memory-mapped, so only about one tile per thread
+    is held in memory at once.
+    @param wrapped_file, a raw file of float32 phases in C order, as
+    written by ndarray.tofile or numpy.memmap
+    @param unwrapped_file, the raw float32 file to write, which is only
+    replaced once the unwrap has succeeded; it may not be wrapped_file
+    or mask_file
+    @param shape, the (rows, columns) of the grid
+    @param mask_file, an optional raw uint8 file, 255 at the points to unwrap
+    @param tile_size, the side of the square tiles
+    @param nthreads, the number of threads to use; 0 uses one per CPU
+    """
+
+    Unwrap2DTiled(wrapped_file, unwrapped_file, tuple(shape), mask_file,
+                  tile_size, nthreads)
 
     
 def normalize_angle(a):
@@ -0,0 +1,498 @@
+//Benchmark for the unwrapper, linked against libunwrap2D.a. Build and run
+//it with
+//
+//   make bench
+//
+//or run ./bench_unwrap [-o results.csv] [-r repeats] [-t threads] [size ...]
+//for square maps of the given sizes (64, 256, 1024, 4096 and 8192 by
+//default), unwrapped on the given number of threads (1 by default, 0 for
+//one per CPU).
+//
+//Every size is unwrapped from five reproducible wrapped surfaces: a planar
+//ramp, a sum of Gaussian bumps, a bump under strong speckle noise, bumps
+//with large masked holes and bumps through a circular aperture. Each is
+//unwrapped with the PIXELM layout merging with linked lists, union-find and
+//Boruvka, with the compact and the sparse layouts, and with the PIXELMs in
+//blocks merging with linked lists and union-find. The
+//best of the repeats is reported as megapixels/s of each stage, from the
+//UNWRAP_STATS of the unwrap, with the peak resident memory of the unwrap.
+//Sizes which would not fit in the memory of the machine are skipped.
+//
+//Then the edges of the bump are sorted with quicker_sort, with
+//radix_sort on one and on all CPUs and with the 4096 buckets of
+//bucket_sort on all CPUs, each from the same unsorted copy.
+//
+//With -o every result is also written to a CSV file, one row per stage,
+//for comparing the sort and merge throughput of different versions.
+
+#include "Munther_2D_unwrap.h"
+#include "unwrap_threads.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+static double seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+//the generators use their own random numbers, so every machine and C
+//library makes the same surfaces
+static unsigned long long random_state;
+
+static void seed_random(unsigned long long seed)
+{
+  random_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+//uniform in [0, 1), from xorshift64*
+static double uniform(void)
+{
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return ((random_state * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static float wrap_phase(double phase)
+{
+  return (float) (phase - 2 * M_PI * floor((phase + M_PI) / (2 * M_PI)));
+}
+
+//a plane rising 0.3 radians a pixel along a row and 0.2 down a column
+static void ramp(float *wrapped, BYTE *input_mask, int n_pe, int n_fe)
+{
+  int i, j;
+  for (i = 0; i < n_pe; i++)
+    for (j = 0; j < n_fe; j++)
+      wrapped[i * n_fe + j] = wrap_phase(0.3 * j + 0.2 * i);
+  memset(input_mask, 255, (size_t) n_pe * n_fe);
+}
+
+//a sum of eight Gaussian bumps, scaled with the image so the steepest
+//slope is below a radian a pixel at every size
+#define BUMPS 8
+static void bumps(float *wrapped, BYTE *input_mask, int n_pe, int n_fe)
+{
+  double x0[BUMPS], y0[BUMPS], height[BUMPS];
+  double x, y, phase, sigma = 0.125;
+  int i, j, k;
+
+  seed_random(2);
+  for (k = 0; k < BUMPS; k++)
+  {
+    x0[k] = uniform();
+    y0[k] = uniform();
+    height[k] = (uniform() - 0.3) * 0.25 * (n_pe < n_fe ? n_pe : n_fe);
+  }
+  for (i = 0; i < n_pe; i++)
+  {
+    y = (i + 0.5) / n_pe;
+    for (j = 0; j < n_fe; j++)
+    {
+      x = (j + 0.5) / n_fe;
+      phase = 0;
+      for (k = 0; k < BUMPS; k++)
+        phase += height[k] * exp(-((x - x0[k]) * (x - x0[k]) +
+                                   (y - y0[k]) * (y - y0[k])) /
+                                 (2 * sigma * sigma));
+      wrapped[i * n_fe + j] = wrap_phase(phase);
+    }
+  }
+  memset(input_mask, 255, (size_t) n_pe * n_fe);
+}
+
+//the bumps under uniform noise of +-2 radians, so many edges are unreliable
+//and the order of the merges is nearly random
+static void speckle(float *wrapped, BYTE *input_mask, int n_pe, int n_fe)
+{
+  size_t k, image_size = (size_t) n_pe * n_fe;
+
+  bumps(wrapped, input_mask, n_pe, n_fe);
+  seed_random(3);
+  for (k = 0; k < image_size; k++)
+    wrapped[k] = wrap_phase(wrapped[k] + 4.0 * (uniform() - 0.5));
+}
+
+//the bumps with twelve discs masked out, a third of the image or so, which
+//leaves islands to be merged separately
+#define HOLES 12
+static void holes(float *wrapped, BYTE *input_mask, int n_pe, int n_fe)
+{
+  double x0[HOLES], y0[HOLES], radius[HOLES];
+  double x, y;
+  int i, j, k;
+
+  bumps(wrapped, input_mask, n_pe, n_fe);
+  seed_random(4);
+  for (k = 0; k < HOLES; k++)
+  {
+    x0[k] = uniform();
+    y0[k] = uniform();
+    radius[k] = 0.05 + 0.1 * uniform();
+  }
+  for (i = 0; i < n_pe; i++)
+  {
+    y = (i + 0.5) / n_pe;
+    for (j = 0; j < n_fe; j++)
+    {
+      x = (j + 0.5) / n_fe;
+      for (k = 0; k < HOLES; k++)
+        if ((x - x0[k]) * (x - x0[k]) + (y - y0[k]) * (y - y0[k]) <
+            radius[k] * radius[k])
+          input_mask[i * n_fe + j] = 0;
+    }
+  }
+}
+
+//the bumps seen through a circular aperture touching the borders, which
+//masks a fifth of the image
+static void aperture(float *wrapped, BYTE *input_mask, int n_pe, int n_fe)
+{
+  double x, y;
+  int i, j;
+
+  bumps(wrapped, input_mask, n_pe, n_fe);
+  for (i = 0; i < n_pe; i++)
+  {
+    y = (i + 0.5) / n_pe - 0.5;
+    for (j = 0; j < n_fe; j++)
+    {
+      x = (j + 0.5) / n_fe - 0.5;
+      if (x * x + y * y > 0.25) input_mask[i * n_fe + j] = 0;
+    }
+  }
+}
+
+typedef void (*GENERATOR)(float *wrapped, BYTE *input_mask, int n_pe,
+                          int n_fe);
+
+static const struct {const char *name; GENERATOR generate;} generators[] =
+{
+  {"ramp", ramp}, {"bumps", bumps}, {"speckle", speckle}, {"holes", holes},
+  {"aperture", aperture}
+};
+
+static const struct {const char *name; PIXEL_LAYOUT layout;
+                     MERGE_METHOD merge_method;} variants[] =
+{
+  {"linked_list", PIXELM_ARRAY, LINKED_LIST},
+  {"union_find", PIXELM_ARRAY, UNION_FIND},
+  {"boruvka", PIXELM_ARRAY, BORUVKA},
+  {"compact", COMPACT_ARRAYS, UNION_FIND},
+  {"sparse", SPARSE_ARRAYS, LINKED_LIST},
+  {"blocks", PIXELM_BLOCKS, LINKED_LIST},
+  {"blocks_uf", PIXELM_BLOCKS, UNION_FIND}
+};
+
+#define N_GENERATORS (int) (sizeof(generators) / sizeof(generators[0]))
+#define N_VARIANTS (int) (sizeof(variants) / sizeof(variants[0]))
+
+//restart the peak resident memory of the process from what it uses now.
+//Only Linux can do that; elsewhere the peak is that of the whole run.
+static void reset_peak_memory(void)
+{
+  FILE *file = fopen("/proc/self/clear_refs", "w");
+  if (file == NULL) return;
+  fputs("5", file);
+  fclose(file);
+}
+
+//the peak resident memory in kilobytes
+static long peak_memory(void)
+{
+  struct rusage usage;
+  char line[128];
+  long peak = -1;
+  FILE *file = fopen("/proc/self/status", "r");
+
+  if (file != NULL)
+  {
+    while (fgets(line, sizeof(line), file) != NULL)
+      if (sscanf(line, "VmHWM: %ld", &peak) == 1) break;
+    fclose(file);
+  }
+  if (peak >= 0) return peak;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+static size_t physical_memory(void)
+{
+  return (size_t) sysconf(_SC_PHYS_PAGES) * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static FILE *results = NULL;
+static int n_threads = 1;
+
+static void result(const char *bench, const char *variant,
+                   const char *generator, int size, long No_of_edges,
+                   const char *stage, double time, long peak_kb)
+{
+  if (results == NULL) return;
+  fprintf(results, "%s,%s,%s,%d,%ld,%s,%.6f,%.3f,%ld\n", bench, variant,
+          generator, size, No_of_edges, stage, time,
+          time > 0 ? (double) size * size / time / 1e6 : 0.0, peak_kb);
+}
+
+//megapixels/s of a stage, for the table
+static double rate(int size, double time)
+{
+  return time > 0 ? (double) size * size / time / 1e6 : 0.0;
+}
+
+static void bench_unwrap(int size, int repeats)
+{
+  size_t image_size = (size_t) size * size;
+  size_t needed;
+  float *wrapped = NULL, *unwrapped = NULL;
+  BYTE *input_mask = NULL;
+  UNWRAP_CONTEXT ctx;
+  UNWRAP_STATS stats, best = {0};
+  long peak_kb;
+  int g, v, r;
+
+  wrapped = (float *) malloc(image_size * sizeof(float));
+  unwrapped = (float *) malloc(image_size * sizeof(float));
+  input_mask = (BYTE *) malloc(image_size);
+  if (!wrapped || !unwrapped || !input_mask)
+  {
+    printf("%5d  not enough memory\n", size);
+    goto cleanup;
+  }
+  if (repeats <= 0)
+  {
+    //about four million pixels in all for the small sizes
+    repeats = (int) ((4 << 20) / image_size);
+    if (repeats < 1) repeats = 1;
+    if (repeats > 20) repeats = 20;
+  }
+  for (g = 0; g < N_GENERATORS; g++)
+  {
+    generators[g].generate(wrapped, input_mask, size, size);
+    for (v = 0; v < N_VARIANTS; v++)
+    {
+      initialise_unwrap_context(&ctx);
+      ctx.layout = variants[v].layout;
+      ctx.merge_method = variants[v].merge_method;
+      ctx.n_threads = n_threads;
+      ctx.stats = &stats;
+      //the images themselves and the buffers of the unwrapper
+      needed = image_size * (2 * sizeof(float) + sizeof(BYTE)) +
+               unwrap_workspace_size(&ctx, size, size, 0);
+      if (needed > physical_memory() / 10 * 9)
+      {
+        printf("%5d %-8s %-11s  skipped, needs %zu MB\n", size,
+               generators[g].name, variants[v].name, needed >> 20);
+        continue;
+      }
+      reset_peak_memory();
+      for (r = 0; r < repeats; r++)
+      {
+        if (phase_unwrap_2D_ctx(&ctx, wrapped, unwrapped, input_mask,
+                                size, size) == 0)
+        {
+          printf("%5d %-8s %-11s  failed\n", size, generators[g].name,
+                 variants[v].name);
+          break;
+        }
+        if (r == 0 || stats.total_seconds < best.total_seconds) best = stats;
+      }
+      if (r < repeats) continue;
+      peak_kb = peak_memory();
+
+      printf("%5d %-8s %-11s %10ld %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f"
+             " %8.1f\n", size, generators[g].name, variants[v].name,
+             best.No_of_edges, rate(size, best.mask_seconds),
+             rate(size, best.reliability_seconds),
+             rate(size, best.edges_seconds), rate(size, best.sort_seconds),
+             rate(size, best.merge_seconds), rate(size, best.return_seconds),
+             rate(size, best.total_seconds), peak_kb / 1024.0);
+      fflush(stdout);
+#define STAGE(stage) result("unwrap", variants[v].name, generators[g].name, \
+                            size, best.No_of_edges, #stage,                 \
+                            best.stage##_seconds, peak_kb)
+      STAGE(mask);
+      STAGE(reliability);
+      STAGE(edges);
+      STAGE(sort);
+      STAGE(merge);
+      STAGE(return);
+      STAGE(total);
+#undef STAGE
+    }
+  }
+
+cleanup:
+  free(input_mask);
+  free(unwrapped);
+  free(wrapped);
+}
+
+static int is_sorted(EDGE *edge, int No_of_edges)
+{
+  int k;
+  for (k = 1; k < No_of_edges; k++)
+    if (edge[k].reliab < edge[k - 1].reliab) return 0;
+  return 1;
+}
+
+static void bench_sort(int size)
+{
+  UNWRAP_CONTEXT ctx;
+  size_t image_size = (size_t) size * size;
+  float *wrapped = NULL;
+  BYTE *input_mask = NULL, *extended_mask = NULL;
+  PIXELM *pixel = NULL;
+  EDGE *unsorted = NULL, *edge = NULL, *buffer = NULL;
+  int n_threads = unwrap_default_threads();
+  double start, quick, radix_1, radix_n, buckets;
+
+  //the pixels and three copies of the edges
+  if (image_size * (sizeof(PIXELM) + 6 * sizeof(EDGE)) >
+      physical_memory() / 10 * 9)
+  {
+    printf("%5d  skipped, not enough memory\n", size);
+    return;
+  }
+  wrapped = (float *) malloc(image_size * sizeof(float));
+  input_mask = (BYTE *) malloc(image_size);
+  extended_mask = (BYTE *) calloc(image_size, 1);
+  pixel = (PIXELM *) calloc(image_size, sizeof(PIXELM));
+  unsorted = (EDGE *) malloc(2 * image_size * sizeof(EDGE));
+  edge = (EDGE *) malloc(2 * image_size * sizeof(EDGE));
+  buffer = (EDGE *) malloc(2 * image_size * sizeof(EDGE));
+  if (!wrapped || !input_mask || !extended_mask || !pixel || !unsorted ||
+      !edge || !buffer)
+  {
+    printf("%5d  not enough memory\n", size);
+    goto cleanup;
+  }
+  bumps(wrapped, input_mask, size, size);
+  initialise_unwrap_context(&ctx);
+  if (!extend_mask(&ctx, input_mask, extended_mask, size, size) ||
+      !initialisePIXELs(&ctx, wrapped, input_mask, extended_mask, pixel,
+                        size, size) ||
+      !calculate_reliability(&ctx, wrapped, pixel, size, size) ||
+      !horizentalEDGEs(&ctx, pixel, unsorted, size, size) ||
+      !verticalEDGEs(&ctx, pixel, unsorted, size, size))
+  {
+    printf("%5d  not enough memory\n", size);
+    goto cleanup;
+  }
+
+  memcpy(edge, unsorted, ctx.No_of_edges * sizeof(EDGE));
+  start = seconds();
+  quicker_sort(edge, edge + ctx.No_of_edges - 1);
+  quick = seconds() - start;
+
+  memcpy(edge, unsorted, ctx.No_of_edges * sizeof(EDGE));
+  start = seconds();
+  radix_sort(edge, buffer, ctx.No_of_edges, 1);
+  radix_1 = seconds() - start;
+
+  memcpy(edge, unsorted, ctx.No_of_edges * sizeof(EDGE));
+  start = seconds();
+  bucket_sort(edge, buffer, ctx.No_of_edges, 4096, n_threads);
+  buckets = seconds() - start;
+
+  //the last, so that the edges checked by is_sorted are those of radix_sort
+  memcpy(edge, unsorted, ctx.No_of_edges * sizeof(EDGE));
+  start = seconds();
+  radix_sort(edge, buffer, ctx.No_of_edges, n_threads);
+  radix_n = seconds() - start;
+
+  printf("%5d %10d %10.3f %10.3f %10.3f %10.3f %8.2fx %s\n", size, 
+         ctx.No_of_edges, quick, radix_1, radix_n, buckets, quick / radix_n,
+         is_sorted(edge, ctx.No_of_edges) ? "" : "NOT SORTED");
+  result("sort", "quicker_sort", "bumps", size, ctx.No_of_edges, "sort",
+         quick, -1);
+  result("sort", "radix_sort_1", "bumps", size, ctx.No_of_edges, "sort",
+         radix_1, -1);
+  result("sort", "radix_sort_n", "bumps", size, ctx.No_of_edges, "sort",
+         radix_n, -1);
+  result("sort", "bucket_sort_4096", "bumps", size, ctx.No_of_edges, "sort",
+         buckets, -1);
+
+cleanup:
+  free(buffer);
+  free(edge);
+  free(unsorted);
+  free(pixel);
+  free(extended_mask);
+  free(input_mask);
+  free(wrapped);
+}
+
+int main(int argc, char **argv)
+{
+  int default_sizes[] = {64, 256, 1024, 4096, 8192};
+  int n_default = sizeof(default_sizes) / sizeof(default_sizes[0]);
+  int *sizes = default_sizes, n_sizes = n_default;
+  int repeats = 0, i, first = 1;
+
+  while (first < argc && argv[first][0] == '-')
+  {
+    if (strcmp(argv[first], "-o") == 0 && first + 1 < argc)
+    {
+      results = fopen(argv[first + 1], "w");
+      if (results == NULL)
+      {
+        perror(argv[first + 1]);
+        return 1;
+      }
+      fprintf(results, "bench,variant,generator,size,edges,stage,seconds,"
+                       "megapixels_per_second,peak_kb\n");
+      first += 2;
+    }
+    else if (strcmp(argv[first], "-r") == 0 && first + 1 < argc)
+    {
+      repeats = atoi(argv[first + 1]);
+      first += 2;
+    }
+    else if (strcmp(argv[first], "-t") == 0 && first + 1 < argc)
+    {
+      n_threads = atoi(argv[first + 1]);
+      first += 2;
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [-o results.csv] [-r repeats] [-t threads] "
+                      "[size ...]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (first < argc)
+  {
+    n_sizes = argc - first;
+    sizes = (int *) malloc(n_sizes * sizeof(int));
+    for (i = 0; i < n_sizes; i++) sizes[i] = atoi(argv[first + i]);
+  }
+
+  printf("unwrapping on %d threads, megapixels/s of each stage, best of the "
+         "repeats\n", n_threads > 0 ? n_threads : unwrap_default_threads());
+  printf(" size surface  layout           edges     mask   reliab    edges"
+         "     sort    merge   return    total  peak MB\n");
+  for (i = 0; i < n_sizes; i++) bench_unwrap(sizes[i], repeats);
+
+  printf("\nsorting edges, radix_sort on 1 and on %d threads\n",
+         unwrap_default_threads());
+  printf(" size      edges  quick (s)  radix (s) radix N (s) bucket (s)"
+         "  speedup\n");
+  for (i = 0; i < n_sizes; i++) bench_sort(sizes[i]);
+
+  if (results != NULL) fclose(results);
+  if (sizes != default_sizes) free(sizes);
+  return 0;
+}
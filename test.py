@@ -1,7 +1,9 @@
 from __future__ import print_function
 import numpy
 import sys
-from __init__ import unwrap2D
+from __init__ import unwrap2D, unwrap2Dstack, unwrap3D, unwrap2Dtiled, \
+     UnwrapPlan, UnwrapStream, unwrap2Dcounts, unwrap2Dpyramid
+import os, tempfile
 
 phaseR=lambda x : numpy.arctan2(x.imag,x.real)
 
@@ -22,6 +24,188 @@ print("Unwrapped-start difference: {0:5.3g}".format(
       numpy.var((phaseStart-phaseUnwrapped).ravel().take(maskI))))
 sys.stdout.flush()
 
+print("<< STACK OF NOISELESS")
+stackWrapped=numpy.array([phaseWrapped]*8)
+stackUnwrapped=unwrap2Dstack(stackWrapped,mask)
+print("Stack-single difference: {0:5.3g}".format(
+      abs(stackUnwrapped-phaseUnwrapped).max()))
+sys.stdout.flush()
+
+print("<< OUT= AND BOOL MASK NOISELESS")
+outUnwrapped=numpy.empty(phaseWrapped.shape,numpy.float32)
+unwrap2D(phaseWrapped.astype(numpy.float32),mask.astype(bool),out=outUnwrapped)
+print("Out-single difference: {0:5.3g}".format(
+      abs(outUnwrapped-phaseUnwrapped).max()))
+sys.stdout.flush()
+
+print("<< FLOAT64 AND MIXED PRECISION NOISELESS")
+singleUnwrapped=unwrap2D(phaseWrapped.astype(numpy.float32),mask)
+mixedUnwrapped=numpy.empty(phaseWrapped.shape,numpy.float64)
+unwrap2D(phaseWrapped.astype(numpy.float32),mask,out=mixedUnwrapped)
+for name,unwrapped in ("Float64",phaseUnwrapped),("Mixed",mixedUnwrapped):
+   print("{0} ({1})-float32 difference: {2:5.3g}".format(
+         name,unwrapped.dtype,abs(unwrapped-singleUnwrapped).max()))
+sys.stdout.flush()
+
+print("<< WRAP COUNTS NOISELESS")
+for countType in numpy.int8,numpy.int16:
+   counts=unwrap2Dcounts(phaseWrapped,mask,countType)
+   countsUnwrapped=phaseWrapped+2*numpy.pi*counts
+   print("{0} counts-single difference: {1:5.3g}".format(
+         counts.dtype,abs(countsUnwrapped-singleUnwrapped).ravel().take(
+         maskI).max()))
+sys.stdout.flush()
+
+print("<< INTERFEROGRAM NOISELESS")
+interferogram=(1+radius/31**2.0)*numpy.exp(1j*phaseStart)
+for complexType in numpy.complex64,numpy.complex128:
+   complexUnwrapped=unwrap2D(interferogram.astype(complexType),mask)
+   print("{0} ({1}) unwrapped-start difference: {2:5.3g}".format(
+         numpy.dtype(complexType),complexUnwrapped.dtype,
+         numpy.var((phaseStart-complexUnwrapped).ravel().take(maskI))))
+sys.stdout.flush()
+
+print("<< QUALITY AND RELIABILITY MAPS NOISELESS")
+reliability=numpy.empty(phaseWrapped.shape,numpy.float32)
+reliabilityUnwrapped=unwrap2D(phaseWrapped,mask,reliability=reliability)
+qualityUnwrapped=unwrap2D(phaseWrapped,mask,quality=reliability)
+print("Reliability-single difference: {0:5.3g}".format(
+      abs(reliabilityUnwrapped-phaseUnwrapped).max()))
+print("Quality-reliability difference: {0:5.3g}".format(
+      abs(qualityUnwrapped-reliabilityUnwrapped).max()))
+qualityUnwrapped=unwrap2D(phaseWrapped,mask,quality=radius)
+print("Radius quality unwrapped-start difference: {0:5.3g}".format(
+      numpy.var((phaseStart-qualityUnwrapped).ravel().take(maskI))))
+sys.stdout.flush()
+
+print("<< PYRAMID OF LARGE NOISELESS")
+radiusLarge=numpy.add.outer(
+   (numpy.arange(512)-255.5)**2.0,(numpy.arange(512)-255.5)**2.0 )
+maskLarge=1*(radiusLarge<255**2.0)
+maskLargeI=numpy.flatnonzero( maskLarge.ravel() )
+phaseStartLarge=radiusLarge*6*2*numpy.pi/255**2.0
+phaseWrappedLarge=(phaseStartLarge+numpy.pi)%(numpy.pi*2)-numpy.pi
+singleUnwrapped=unwrap2D(phaseWrappedLarge,maskLarge)
+pyramidStats={}
+pyramidUnwrapped=unwrap2Dpyramid(phaseWrappedLarge,maskLarge,
+                                 stats=pyramidStats,levels=3)
+print("Pyramid-single difference: {0:5.3g}".format(
+      numpy.var((pyramidUnwrapped-singleUnwrapped).ravel()
+                .take(maskLargeI))))
+print("Pyramid edges, dirty points: {0}, {1}".format(
+      pyramidStats['edges'],pyramidStats['dirty']))
+sys.stdout.flush()
+
+print("<< PYRAMID OF STEEP NOISELESS")
+# nearly a radian per point at the rim, which the coarser levels alias
+phaseStartSteep=radiusLarge*20*2*numpy.pi/255**2.0
+phaseWrappedSteep=(phaseStartSteep+numpy.pi)%(numpy.pi*2)-numpy.pi
+singleUnwrapped=unwrap2D(phaseWrappedSteep,maskLarge)
+pyramidUnwrapped=unwrap2Dpyramid(phaseWrappedSteep,maskLarge,levels=2)
+print("Steep pyramid-single difference: {0:5.3g}".format(
+      numpy.var((pyramidUnwrapped-singleUnwrapped).ravel()
+                .take(maskLargeI))))
+sys.stdout.flush()
+
+print("<< PYRAMID OF TILTED NOISELESS WITH WRAPAROUND")
+# not periodic, so every wraparound edge of the unmasked grid is a jump
+rowsLarge,columnsLarge=numpy.indices((512,512))
+phaseStartTilted=0.4*columnsLarge+0.0006*rowsLarge**2.0+ \
+   0.0002*columnsLarge*rowsLarge
+phaseWrappedTilted=(phaseStartTilted+numpy.pi)%(numpy.pi*2)-numpy.pi
+singleUnwrapped=unwrap2D(phaseWrappedTilted,wrap_around=(True,True))
+pyramidUnwrapped=unwrap2Dpyramid(phaseWrappedTilted,levels=2,
+                                 wrap_around=(True,True))
+print("Tilted pyramid-single difference: {0:5.3g}".format(
+      numpy.var((pyramidUnwrapped-singleUnwrapped).ravel())))
+sys.stdout.flush()
+
+print("<< PLAN NOISELESS")
+plan=UnwrapPlan(phaseWrapped.shape)
+planWrapped=phaseWrapped.astype(numpy.float32)
+planMask=(255*mask).astype(numpy.uint8)
+planUnwrapped=numpy.empty(phaseWrapped.shape,numpy.float32)
+for frame in range(4):
+   plan(planWrapped,planUnwrapped,planMask)
+print("Plan-single difference: {0:5.3g}".format(
+      abs(planUnwrapped-phaseUnwrapped).max()))
+sys.stdout.flush()
+
+print("<< STATS NOISELESS")
+stats={}
+statsUnwrapped=unwrap2D(phaseWrapped,mask,stats=stats)
+print("Stats-single difference: {0:5.3g}".format(
+      abs(statsUnwrapped-phaseUnwrapped).max()))
+print("Groups {0[groups]:d}, merges {0[merges]:d}, edges {0[edges]:d}, "
+      "{0[total_seconds]:5.3g}s".format(stats))
+sys.stdout.flush()
+
+print("<< BUCKETS NOISELESS")
+bucketsUnwrapped=unwrap2D(phaseWrapped,mask,buckets=4096)
+print("Buckets-single difference: {0:5.3g}".format(
+      abs(bucketsUnwrapped-phaseUnwrapped).max()))
+sys.stdout.flush()
+
+print("<< RAMP NOISELESS, NO MASK, WITH AND WITHOUT WRAPAROUND")
+rampStart=numpy.add.outer(numpy.arange(64)*0.9,numpy.arange(64)*0.7)
+rampWrapped=(rampStart+numpy.pi)%(numpy.pi*2)-numpy.pi
+for wrapAround in (False,False),(True,True):
+   rampUnwrapped=unwrap2D(rampWrapped,wrap_around=wrapAround)
+   print("Wraparound {0}: unwrapped-start difference: {1:5.3g}".format(
+         wrapAround,numpy.var((rampStart-rampUnwrapped).ravel())))
+sys.stdout.flush()
+
+print("<< STREAM NOISELESS")
+stream=UnwrapStream(phaseWrapped.shape)
+streamUnwrapped=numpy.empty(phaseWrapped.shape,numpy.float32)
+streamDirty=[]
+for frame in range(8):
+   frameStart=phaseStart*(1+0.02*frame)
+   frameWrapped=((frameStart+numpy.pi)%(numpy.pi*2)-numpy.pi).astype(numpy.float32)
+   stream(frameWrapped,streamUnwrapped,planMask)
+   streamDirty.append(stream.dirty)
+print("Stream-start difference: {0:5.3g}".format(
+      numpy.var((frameStart-streamUnwrapped).ravel().take(maskI))))
+print("Re-resolved points per frame: {0}".format(streamDirty))
+sys.stdout.flush()
+
+print("<< 3D NOISELESS")
+radius3D=numpy.add.outer(radius,(numpy.arange(32)-15.5)**2.0)
+mask3D=1*(radius3D<31**2.0)
+mask3DI=numpy.flatnonzero( mask3D.ravel() )
+phaseStart3D=radius3D*6*2*numpy.pi/31**2.0
+phaseWrapped3D=(phaseStart3D+numpy.pi)%(numpy.pi*2)-numpy.pi
+phaseUnwrapped3D=unwrap3D(phaseWrapped3D,mask3D)
+print("Unwrapped-start difference: {0:5.3g}".format(
+      numpy.var((phaseStart3D-phaseUnwrapped3D).ravel().take(mask3DI))))
+sys.stdout.flush()
+
+print("<< 3D RAMP NOISELESS, NO MASK, WITH AND WITHOUT WRAPAROUND")
+for shape,wrapAround in (((20,20,20),(False,False,False)),
+                         ((20,20,20),(True,True,True)),
+                         ((1,16,16),(False,True,True))):
+   ramp3DStart=numpy.add.outer(numpy.add.outer(numpy.arange(shape[0])*1.0,
+      numpy.arange(shape[1])*1.5),numpy.arange(shape[2])*2.0)
+   ramp3DWrapped=(ramp3DStart+numpy.pi)%(numpy.pi*2)-numpy.pi
+   ramp3DUnwrapped=unwrap3D(ramp3DWrapped,wrap_around=wrapAround)
+   print("{0} wraparound {1}: unwrapped-start difference: {2:5.3g}".format(
+         shape,wrapAround,numpy.var((ramp3DStart-ramp3DUnwrapped).ravel())))
+sys.stdout.flush()
+
+print("<< TILED NOISELESS")
+tileDir=tempfile.mkdtemp()
+phaseWrapped.astype(numpy.float32).tofile(os.path.join(tileDir,"wrapped"))
+(255*mask).astype(numpy.uint8).tofile(os.path.join(tileDir,"mask"))
+unwrap2Dtiled(os.path.join(tileDir,"wrapped"),os.path.join(tileDir,"unwrapped"),
+              phaseWrapped.shape,os.path.join(tileDir,"mask"),tile_size=16)
+tiledUnwrapped=numpy.fromfile(os.path.join(tileDir,"unwrapped"),
+      numpy.float32).reshape(phaseWrapped.shape)
+print("Unwrapped-start difference: {0:5.3g}".format(
+      numpy.var((phaseStart-tiledUnwrapped).ravel().take(maskI))))
+for name in "wrapped","mask","unwrapped": os.remove(os.path.join(tileDir,name))
+os.rmdir(tileDir)
+sys.stdout.flush()
+
 
 # now with noise
 print("<< WITH NOISE, UNIFORM PHASE, GAUSSIAN AMPLITUDE")
@@ -0,0 +1,321 @@
+//The blocked layout of the unwrapper, which keeps the PIXELMs in square
+//blocks of BLOCK_SIZE x BLOCK_SIZE pixels instead of in rows. Once the
+//edges are sorted by reliability the merges visit the pixels in nearly
+//random order, and in rows the two pixels of a vertical edge, and the
+//heads and tails of neighbouring groups, are a row of PIXELMs apart. In
+//blocks most of them share a block, which fits in the first level cache.
+//
+//The image is cut into bands of BLOCK_SIZE rows (the last one may be
+//shorter), each band into blocks of BLOCK_SIZE columns (the last one may
+//be narrower), and the blocks of a band follow each other, so the array
+//has no padding. The pixels of a block are stored by rows.
+//
+//The reliabilities, the edges and their order are those of
+//phase_unwrap_2D_ctx, so the sorts and merges of the PIXELM layout are used
+//as they are and the unwrapped image is the same. The image is put back in
+//rows only when it is returned. Everything but the sort and the merge is
+//done on one thread.
+
+#include "Munther_2D_unwrap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE 16
+
+static float TWOPI = 6.283185307;
+
+struct BLOCKS
+{
+  PIXELM *pixel;
+  EDGE *edge;
+  int No_of_edges;
+  int image_width;
+  int image_height;
+  int *row_index[2];            //the block_index of each pixel of two rows
+};
+
+typedef struct BLOCKS BLOCKS;
+
+//the index in the blocked array of the pixel in row i and column j
+static ALWAYS_INLINE int block_index(BLOCKS *blocks, int i, int j)
+{
+  int band = i - i % BLOCK_SIZE;
+  int column = j - j % BLOCK_SIZE;
+  int band_height = blocks->image_height - band;
+  int block_width = blocks->image_width - column;
+
+  if (band_height > BLOCK_SIZE) band_height = BLOCK_SIZE;
+  if (block_width > BLOCK_SIZE) block_width = BLOCK_SIZE;
+  return band * blocks->image_width + column * band_height +
+         (i - band) * block_width + (j - column);
+}
+
+//the block_index of every pixel of row i, a block at a time
+static void block_row(BLOCKS *blocks, int i, int *row_index)
+{
+  int band = i - i % BLOCK_SIZE;
+  int band_height = blocks->image_height - band;
+  int column, block_width, start, j;
+
+  if (band_height > BLOCK_SIZE) band_height = BLOCK_SIZE;
+  for (column = 0; column < blocks->image_width; column += BLOCK_SIZE)
+  {
+    block_width = blocks->image_width - column;
+    if (block_width > BLOCK_SIZE) block_width = BLOCK_SIZE;
+    start = band * blocks->image_width + column * band_height +
+            (i - band) * block_width;
+    for (j = 0; j < block_width; j++)
+      row_index[column + j] = start + j;
+  }
+}
+
+//initialisePIXELs and calculate_reliability into the blocks
+static void block_pixels(UNWRAP_CONTEXT *ctx, BLOCKS *blocks,
+                         float *WrappedImage, BYTE *input_mask,
+                         unsigned long long *extended_bits,
+                         float *row_reliability)
+{
+  int image_width = blocks->image_width;
+  int image_height = blocks->image_height;
+  int words = MASK_WORDS(image_width);
+  unsigned long long *extended_row;
+  RELIABILITY_ROW reliability_row = reliability_row_kernel(ctx->simd_level);
+  PIXELM *pixel_pointer;
+  float *centre_row;
+  float centre, H, V, D1, D2;
+  int *row_index = blocks->row_index[0];
+  int i, j, up, down, left, right, index;
+
+  for (i = 0; i < image_height; i++)
+  {
+    block_row(blocks, i, row_index);
+    for (j = 0; j < image_width; j++)
+    {
+      index = i * image_width + j;
+      pixel_pointer = blocks->pixel + row_index[j];
+      pixel_pointer->increment = 0;
+      pixel_pointer->number_of_pixels_in_group = 1;
+      pixel_pointer->value = WrappedImage[index];
+      pixel_pointer->reliability = (float) (9999999.0 + rand_r(&ctx->seed));
+      pixel_pointer->input_mask = input_mask[index];
+      pixel_pointer->extended_mask = 
+        (BYTE) (255 * MASK_BIT(extended_bits + i * words, j));
+      pixel_pointer->head = pixel_pointer;
+      pixel_pointer->last = pixel_pointer;
+      pixel_pointer->next = NULL;
+      pixel_pointer->new_group = 0;
+      pixel_pointer->group = -1;
+    }
+  }
+
+  for (i = 0; i < image_height; i++)
+  {
+    block_row(blocks, i, row_index);
+    extended_row = extended_bits + i * words;
+    //the vector kernel does the rows away from the top and bottom
+    if (i > 0 && i < image_height - 1 && image_width > 2)
+    {
+      centre_row = WrappedImage + i * image_width + 1;
+      reliability_row(centre_row - image_width, centre_row,
+                      centre_row + image_width, row_reliability,
+                      image_width - 2);
+      for (j = 1; j < image_width - 1; j++)
+        if (MASK_BIT(extended_row, j))
+          blocks->pixel[row_index[j]].reliability = row_reliability[j - 1];
+    }
+    //and the formula of calculate_reliability does the borders which are
+    //connected, but not the corners
+    for (j = 0; j < image_width; j++)
+    {
+      if (i > 0 && i < image_height - 1 && j == 1) j = image_width - 1;
+      if ((i == 0 || i == image_height - 1) &&
+          (j == 0 || j == image_width - 1 || ctx->y_connectivity != 1))
+        continue;
+      if ((j == 0 || j == image_width - 1) && ctx->x_connectivity != 1)
+        continue;
+      if (!MASK_BIT(extended_row, j)) continue;
+      up = (i == 0) ? image_height - 1 : i - 1;
+      down = (i == image_height - 1) ? 0 : i + 1;
+      left = (j == 0) ? image_width - 1 : j - 1;
+      right = (j == image_width - 1) ? 0 : j + 1;
+#define VALUE(row, column) WrappedImage[(row) * image_width + (column)]
+      centre = VALUE(i, j);
+      H = wrap(VALUE(i, left) - centre) - wrap(centre - VALUE(i, right));
+      V = wrap(VALUE(up, j) - centre) - wrap(centre - VALUE(down, j));
+      D1 = wrap(VALUE(up, left) - centre) - wrap(centre - VALUE(down, right));
+      D2 = wrap(VALUE(up, right) - centre) - wrap(centre - VALUE(down, left));
+#undef VALUE
+      blocks->pixel[row_index[j]].reliability = H*H + V*V + D1*D1 + D2*D2;
+    }
+  }
+}
+
+//the edge from pixel index1 to pixel index2 of the blocks, if neither is
+//masked. mask1 and mask2 are their bits of the packed input mask.
+static void block_add_edge(BLOCKS *blocks, int index1, int index2,
+                           int mask1, int mask2)
+{
+  EDGE *edge = blocks->edge + blocks->No_of_edges;
+  PIXELM *pixel1 = blocks->pixel + index1;
+  PIXELM *pixel2 = blocks->pixel + index2;
+
+  if (mask1 == 0 || mask2 == 0) return;
+  edge->pointer_1 = pixel1;
+  edge->pointer_2 = pixel2;
+  edge->reliab = pixel1->reliability + pixel2->reliability;
+  edge->increment = find_wrap(pixel1->value, pixel2->value);
+  blocks->No_of_edges++;
+}
+
+//the edges from the pixels of row upper to those below them in row lower
+static void block_vertical_edges(BLOCKS *blocks, 
+                                 unsigned long long *input_bits, int upper,
+                                 int lower)
+{
+  int image_width = blocks->image_width;
+  unsigned long long *upper_mask = input_bits + upper * MASK_WORDS(image_width);
+  unsigned long long *lower_mask = input_bits + lower * MASK_WORDS(image_width);
+  int j;
+
+  block_row(blocks, upper, blocks->row_index[0]);
+  block_row(blocks, lower, blocks->row_index[1]);
+  for (j = 0; j < image_width; j++)
+    block_add_edge(blocks, blocks->row_index[0][j], blocks->row_index[1][j],
+                   (int) MASK_BIT(upper_mask, j), (int) MASK_BIT(lower_mask, j));
+}
+
+//the edges are built in the same order as horizentalEDGEs and verticalEDGEs
+static void block_edges(UNWRAP_CONTEXT *ctx, BLOCKS *blocks,
+                        unsigned long long *input_bits)
+{
+  int image_width = blocks->image_width;
+  int image_height = blocks->image_height;
+  int words = MASK_WORDS(image_width);
+  int *row_index = blocks->row_index[0];
+  unsigned long long *row_mask;
+  int i, j;
+
+  blocks->No_of_edges = 0;
+  for (i = 0; i < image_height; i++)
+  {
+    block_row(blocks, i, row_index);
+    row_mask = input_bits + i * words;
+    for (j = 0; j < image_width - 1; j++)
+      block_add_edge(blocks, row_index[j], row_index[j + 1],
+                     (int) MASK_BIT(row_mask, j), (int) MASK_BIT(row_mask, j + 1));
+  }
+  if (ctx->x_connectivity == 1)
+    for (i = 0; i < image_height; i++)
+      block_add_edge(blocks, block_index(blocks, i, image_width - 1),
+                     block_index(blocks, i, 0),
+                     (int) MASK_BIT(input_bits + i * words, image_width - 1),
+                     (int) (input_bits[i * words] & 1));
+  for (i = 0; i < image_height - 1; i++)
+    block_vertical_edges(blocks, input_bits, i, i + 1);
+  if (ctx->y_connectivity == 1)
+    block_vertical_edges(blocks, input_bits, image_height - 1, 0);
+  ctx->No_of_edges = blocks->No_of_edges;
+}
+
+//unwrapImage, maskImage and returnImage for the blocked layout, which
+//puts the image back in rows
+static void block_return(BLOCKS *blocks, BYTE *input_mask,
+                         float *UnwrappedImage)
+{
+  int image_width = blocks->image_width;
+  int image_height = blocks->image_height;
+  int image_size = image_width * image_height;
+  int *row_index = blocks->row_index[0];
+  PIXELM *pixel_pointer;
+  float min = 99999999.;
+  int i, j, index;
+
+  for (i = 0; i < image_height; i++)
+  {
+    block_row(blocks, i, row_index);
+    for (j = 0; j < image_width; j++)
+    {
+      index = i * image_width + j;
+      pixel_pointer = blocks->pixel + row_index[j];
+      UnwrappedImage[index] = pixel_pointer->value +
+                              TWOPI * (float) (pixel_pointer->increment);
+      if (UnwrappedImage[index] < min && input_mask[index] != 0)
+        min = UnwrappedImage[index];
+    }
+  }
+  for (index = 0; index < image_size; index++)
+    if (input_mask[index] == 0)
+      UnwrappedImage[index] = min;
+}
+
+//phase_unwrap_2D_ctx in the blocked layout. Called by phase_unwrap_2D_ctx
+//once the mask is known to be sane. It takes the same buffers of a plan as
+//the PIXELM layout. Returns 0, having copied the wrapped image, if there
+//is not enough memory.
+int phase_unwrap_2D_blocks(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                           float* UnwrappedImage, BYTE* input_mask,
+                           int n_pe, int n_fe)
+{
+  UNWRAP_WORKSPACE *workspace = context_workspace(ctx);
+  int image_size = n_pe * n_fe;
+  size_t mask_size = (size_t) MASK_WORDS(n_fe) * n_pe * 
+                     sizeof(unsigned long long);
+  BLOCKS blocks;
+  unsigned long long *input_bits, *extended_bits;
+  float *row_reliability;
+  double start = 0;
+
+  if (ctx->stats != NULL) start = unwrap_seconds();
+  blocks.image_width = n_fe;
+  blocks.image_height = n_pe;
+  blocks.row_index[0] = (int *) workspace_buffer(workspace->row_index,
+                                                 2 * n_fe * sizeof(int), 0);
+  input_bits = (unsigned long long *) workspace_buffer(workspace->input_bits,
+                                                       mask_size, 0);
+  extended_bits = (unsigned long long *) 
+    workspace_buffer(workspace->extended_bits, mask_size, 0);
+  blocks.pixel = (PIXELM *) workspace_buffer(workspace->pixel,
+                                             image_size * sizeof(PIXELM), 0);
+  blocks.edge = (EDGE *) workspace_buffer(workspace->edge,
+                                          2 * image_size * sizeof(EDGE), 0);
+  row_reliability = (float *) workspace_buffer(workspace->row_reliability,
+                                               n_fe * sizeof(float), 0);
+  if (blocks.row_index[0] == NULL || input_bits == NULL ||
+      extended_bits == NULL || blocks.pixel == NULL || blocks.edge == NULL ||
+      row_reliability == NULL)
+  {
+    release_buffer(workspace->row_reliability, row_reliability);
+    release_buffer(workspace->edge, blocks.edge);
+    release_buffer(workspace->pixel, blocks.pixel);
+    release_buffer(workspace->extended_bits, extended_bits);
+    release_buffer(workspace->input_bits, input_bits);
+    release_buffer(workspace->row_index, blocks.row_index[0]);
+    memmove(UnwrappedImage, WrappedImage, image_size * sizeof(float));
+    return 0;
+  }
+  blocks.row_index[1] = blocks.row_index[0] + n_fe;
+
+  pack_mask(input_mask, input_bits, n_fe, n_pe);
+  extend_mask_bits(ctx, input_bits, extended_bits, n_fe, n_pe);
+  STATS_LAP(ctx, mask_seconds, start);
+  block_pixels(ctx, &blocks, WrappedImage, input_mask, extended_bits,
+               row_reliability);
+  STATS_LAP(ctx, reliability_seconds, start);
+  block_edges(ctx, &blocks, input_bits);
+  STATS_LAP(ctx, edges_seconds, start);
+  sortEDGEs(ctx, blocks.edge, blocks.No_of_edges);
+  STATS_LAP(ctx, sort_seconds, start);
+  mergePIXELs(ctx, blocks.pixel, blocks.edge, n_fe, n_pe);
+  STATS_LAP(ctx, merge_seconds, start);
+  block_return(&blocks, input_mask, UnwrappedImage);
+  STATS_LAP(ctx, return_seconds, start);
+
+  release_buffer(workspace->row_reliability, row_reliability);
+  release_buffer(workspace->edge, blocks.edge);
+  release_buffer(workspace->pixel, blocks.pixel);
+  release_buffer(workspace->extended_bits, extended_bits);
+  release_buffer(workspace->input_bits, input_bits);
+  release_buffer(workspace->row_index, blocks.row_index[0]);
+  return 1;
+}
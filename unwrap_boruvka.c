@@ -0,0 +1,332 @@
+//The BORUVKA merge of the unwrapper: Boruvka's algorithm for the spanning
+//forest of the sorted edges, split over the threads of the context.
+//
+//The sequential merges walk the edges from the most reliable and join two
+//groups whenever an edge connects them, so the edges they keep are the
+//spanning forest of minimum rank, the rank of an edge being its place in
+//the sorted array. No two edges have the same rank, so that forest is
+//unique, and Boruvka's algorithm finds it in rounds which can each be done
+//in parallel:
+//
+// - the edges inside one group are dropped,
+// - every group takes its first edge to another group, with an atomic
+//   minimum of the ranks,
+// - every group is hooked onto the group at the other end of that edge,
+//   except that when two groups take the same edge the one with the lower
+//   root index stays a root, and
+// - the hooks are followed to the new roots by pointer jumping, and every
+//   pixel is pointed at the root of its new group.
+//
+//Every round at least halves the No. of groups which still have edges.
+//The groups and the phase differences inside them are those of
+//gatherPIXELs, but a group is unwrapped relative to another of its pixels,
+//so the unwrapped phase of a group may differ from that of gatherPIXELs by
+//a whole number of 2*pi.
+
+#include "Munther_2D_unwrap.h"
+#include "unwrap_threads.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+//small shares are not worth a thread
+#define FOREST_CHUNK 65536
+
+struct FOREST
+{
+  PIXELM *pixel;                //group is the index of the root of the group
+  EDGE *edge;
+  int No_of_edges;
+  int image_size;
+  int *root;                    //the roots which may still have edges
+  int No_of_roots;
+  int *best;                    //rank of the first edge of each root, or INT_MAX
+  int *hook;                    //the root each root is hooked onto
+  int *hook_increment;          //No. of 2*pi relative to that root
+  int *jump;                    //hook and hook_increment after one jump
+  int *jump_increment;
+  int n_threads;
+  int n;                        //No. of items split into chunks by run_chunks
+  int n_chunks;
+  long *count;                  //one count for each chunk
+  long one_count;               //the count of one thread, which needs no malloc
+};
+
+typedef struct FOREST FOREST;
+
+static void chunk_range(FOREST *forest, int chunk, int *first, int *last)
+{
+  *first = (int) ((long) forest->n * chunk / forest->n_chunks);
+  *last = (int) ((long) forest->n * (chunk + 1) / forest->n_chunks);
+}
+
+//run task on chunks of n items and return the sum of the counts of the
+//chunks
+static long run_chunks(FOREST *forest, int n, UNWRAP_TASK task)
+{
+  long total = 0;
+  int chunk;
+
+  forest->n = n;
+  forest->n_chunks = n / FOREST_CHUNK + 1;
+  if (forest->n_chunks > forest->n_threads)
+    forest->n_chunks = forest->n_threads;
+  run_parallel(forest->n_chunks, forest->n_chunks, task, forest);
+  for (chunk = 0; chunk < forest->n_chunks; chunk++)
+    total += forest->count[chunk];
+  return total;
+}
+
+static void atomic_min(int *target, int value)
+{
+  int current = __atomic_load_n(target, __ATOMIC_RELAXED);
+
+  while (value < current &&
+         !__atomic_compare_exchange_n(target, &current, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void start_pixels(void *forest_pointer, int chunk)
+{
+  FOREST *forest = (FOREST *) forest_pointer;
+  int first, last, k;
+
+  chunk_range(forest, chunk, &first, &last);
+  for (k = first; k < last; k++)
+  {
+    forest->pixel[k].group = k;
+    forest->pixel[k].increment = 0;
+    forest->root[k] = k;
+    forest->best[k] = INT_MAX;
+  }
+  forest->count[chunk] = 0;
+}
+
+//keep the edges of a chunk which join two groups, at the start of the chunk
+static void drop_edges(void *forest_pointer, int chunk)
+{
+  FOREST *forest = (FOREST *) forest_pointer;
+  EDGE *edge = forest->edge;
+  int first, last, k, kept;
+
+  chunk_range(forest, chunk, &first, &last);
+  kept = first;
+  for (k = first; k < last; k++)
+    if (edge[k].pointer_1->group != edge[k].pointer_2->group)
+      edge[kept++] = edge[k];
+  forest->count[chunk] = kept - first;
+}
+
+static void reset_best(void *forest_pointer, int chunk)
+{
+  FOREST *forest = (FOREST *) forest_pointer;
+  int first, last, k;
+
+  chunk_range(forest, chunk, &first, &last);
+  for (k = first; k < last; k++)
+    forest->best[forest->root[k]] = INT_MAX;
+  forest->count[chunk] = 0;
+}
+
+static void find_best(void *forest_pointer, int chunk)
+{
+  FOREST *forest = (FOREST *) forest_pointer;
+  EDGE *edge = forest->edge;
+  int first, last, k;
+
+  chunk_range(forest, chunk, &first, &last);
+  for (k = first; k < last; k++)
+  {
+    atomic_min(forest->best + edge[k].pointer_1->group, k);
+    atomic_min(forest->best + edge[k].pointer_2->group, k);
+  }
+  forest->count[chunk] = 0;
+}
+
+//keep the roots of a chunk which have an edge, at the start of the chunk
+static void keep_roots(void *forest_pointer, int chunk)
+{
+  FOREST *forest = (FOREST *) forest_pointer;
+  int first, last, k, kept;
+
+  chunk_range(forest, chunk, &first, &last);
+  kept = first;
+  for (k = first; k < last; k++)
+    if (forest->best[forest->root[k]] != INT_MAX)
+      forest->root[kept++] = forest->root[k];
+  forest->count[chunk] = kept - first;
+}
+
+//hook every root onto the root at the other end of its first edge. The
+//increments are those of the last two cases of gatherPIXELs_union_find.
+static void hook_roots(void *forest_pointer, int chunk)
+{
+  FOREST *forest = (FOREST *) forest_pointer;
+  PIXELM *pixel1;
+  PIXELM *pixel2;
+  EDGE *edge;
+  int first, last, k, root, other;
+  long No_of_hooks = 0;
+
+  chunk_range(forest, chunk, &first, &last);
+  for (k = first; k < last; k++)
+  {
+    root = forest->root[k];
+    edge = forest->edge + forest->best[root];
+    pixel1 = edge->pointer_1;
+    pixel2 = edge->pointer_2;
+    other = (pixel1->group == root) ? pixel2->group : pixel1->group;
+    if (forest->best[other] == forest->best[root] && root < other)
+    {
+      forest->hook[root] = root;
+      forest->hook_increment[root] = 0;
+      continue;
+    }
+    forest->hook[root] = other;
+    if (pixel1->group == root)
+      forest->hook_increment[root] = pixel2->increment + edge->increment -
+                                     pixel1->increment;
+    else
+      forest->hook_increment[root] = pixel1->increment - edge->increment -
+                                     pixel2->increment;
+    No_of_hooks++;
+  }
+  forest->count[chunk] = No_of_hooks;
+}
+
+//one step of pointer jumping, from hook into jump
+static void jump_roots(void *forest_pointer, int chunk)
+{
+  FOREST *forest = (FOREST *) forest_pointer;
+  int first, last, k, root, hook;
+  long No_of_jumps = 0;
+
+  chunk_range(forest, chunk, &first, &last);
+  for (k = first; k < last; k++)
+  {
+    root = forest->root[k];
+    hook = forest->hook[root];
+    forest->jump[root] = forest->hook[hook];
+    forest->jump_increment[root] = forest->hook_increment[root];
+    if (forest->hook[hook] != hook)
+    {
+      forest->jump_increment[root] += forest->hook_increment[hook];
+      No_of_jumps++;
+    }
+  }
+  forest->count[chunk] = No_of_jumps;
+}
+
+//point every pixel of a hooked group at its new root. The roots which are
+//not in the list of this round have no edge left and are never hooked.
+static void move_pixels(void *forest_pointer, int chunk)
+{
+  FOREST *forest = (FOREST *) forest_pointer;
+  PIXELM *pixel = forest->pixel;
+  int first, last, k, root;
+  long No_of_moved = 0;
+
+  chunk_range(forest, chunk, &first, &last);
+  for (k = first; k < last; k++)
+  {
+    root = pixel[k].group;
+    if (forest->best[root] == INT_MAX || forest->hook[root] == root)
+      continue;
+    pixel[k].group = forest->hook[root];
+    pixel[k].increment += forest->hook_increment[root];
+    No_of_moved++;
+  }
+  forest->count[chunk] = No_of_moved;
+}
+
+//close up what the chunks of the last run_chunks kept at their starts,
+//and return the No. of items kept
+static int close_up(FOREST *forest, void *items, size_t item_size)
+{
+  char *base = (char *) items;
+  int kept = (int) forest->count[0];
+  int chunk, first, last;
+
+  for (chunk = 1; chunk < forest->n_chunks; chunk++)
+  {
+    chunk_range(forest, chunk, &first, &last);
+    memmove(base + kept * item_size, base + first * item_size,
+            forest->count[chunk] * item_size);
+    kept += (int) forest->count[chunk];
+  }
+  return kept;
+}
+
+//gather the pixels into the groups of gatherPIXELs on the threads of the
+//context. The edges are reordered. On return group is the index of the
+//root of the group of each pixel and increment is relative to that root,
+//as after gatherPIXELs_union_find. The six arrays of the forest are one
+//buffer of the workspace. Returns 0, having changed nothing, if there is
+//not enough memory.
+int gatherPIXELs_boruvka(UNWRAP_CONTEXT *ctx, PIXELM *pixel, EDGE *edge,
+                         int image_width, int image_height)
+{
+  UNWRAP_WORKSPACE *workspace = context_workspace(ctx);
+  FOREST forest;
+  long No_of_merges = 0;
+  long No_of_relinked = 0;
+  int *arrays, *swap_pointer;
+
+  forest.pixel = pixel;
+  forest.edge = edge;
+  forest.No_of_edges = ctx->No_of_edges;
+  forest.image_size = image_width * image_height;
+  forest.n_threads = (ctx->n_threads <= 0) ? unwrap_default_threads() :
+                                             ctx->n_threads;
+  arrays = (int *) workspace_buffer(workspace->forest, 6 * 
+                                    (size_t) forest.image_size * sizeof(int), 0);
+  forest.count = (forest.n_threads == 1) ? &forest.one_count :
+                 (long *) malloc(forest.n_threads * sizeof(long));
+  if (arrays == NULL || forest.count == NULL)
+  {
+    release_buffer(workspace->forest, arrays);
+    if (forest.count != &forest.one_count) free(forest.count);
+    return 0;
+  }
+  forest.root = arrays;
+  forest.best = arrays + forest.image_size;
+  forest.hook = arrays + 2 * (size_t) forest.image_size;
+  forest.hook_increment = arrays + 3 * (size_t) forest.image_size;
+  forest.jump = arrays + 4 * (size_t) forest.image_size;
+  forest.jump_increment = arrays + 5 * (size_t) forest.image_size;
+
+  run_chunks(&forest, forest.image_size, start_pixels);
+  forest.No_of_roots = forest.image_size;
+  for (;;)
+  {
+    run_chunks(&forest, forest.No_of_edges, drop_edges);
+    forest.No_of_edges = close_up(&forest, edge, sizeof(EDGE));
+    if (forest.No_of_edges == 0) break;
+    run_chunks(&forest, forest.No_of_roots, reset_best);
+    run_chunks(&forest, forest.No_of_edges, find_best);
+    run_chunks(&forest, forest.No_of_roots, keep_roots);
+    forest.No_of_roots = close_up(&forest, forest.root, sizeof(int));
+    No_of_merges += run_chunks(&forest, forest.No_of_roots, hook_roots);
+    while (run_chunks(&forest, forest.No_of_roots, jump_roots) > 0)
+    {
+      swap_pointer = forest.hook;
+      forest.hook = forest.jump;
+      forest.jump = swap_pointer;
+      swap_pointer = forest.hook_increment;
+      forest.hook_increment = forest.jump_increment;
+      forest.jump_increment = swap_pointer;
+    }
+    No_of_relinked += run_chunks(&forest, forest.image_size, move_pixels);
+  }
+
+  if (ctx->stats != NULL)
+  {
+    ctx->stats->No_of_merges += No_of_merges;
+    ctx->stats->No_of_relinked += No_of_relinked;
+  }
+  release_buffer(workspace->forest, arrays);
+  if (forest.count != &forest.one_count) free(forest.count);
+  return 1;
+}
@@ -0,0 +1,520 @@
+//The compact layout of the unwrapper. It follows the same steps as
+//phase_unwrap_2D_ctx, with the same reliabilities, edges and merge rules,
+//but keeps no PIXELM or EDGE structures:
+//
+// - the values are read straight from the wrapped image,
+// - the reliabilities are kept in the unwrapped image until the edges are
+//   built (or in a separate array when unwrapping in place),
+// - each pixel has a 32-bit parent index and a 32-bit increment for the
+//   union-find merge of gatherPIXELs_union_find,
+// - each edge is its reliability and the index of its first pixel, with
+//   the direction to the second pixel in the two low bits, and
+// - the input mask is packed into one bit per pixel.
+//
+//That is about 24 bytes per pixel instead of about 104. The edges are
+//sorted in place so no second edge array is needed.
+
+#include "unwrap_compact.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+static float TWOPI = 6.283185307;
+
+//the kinds of edge, by where the second pixel is, in the order
+//compact_edges builds them
+#define RIGHT_NEIGHBOUR   0
+#define RIGHT_WRAPAROUND  1       //from the right border to the left border
+#define LOWER_NEIGHBOUR   2
+#define LOWER_WRAPAROUND  3       //from the bottom border to the top border
+
+void compact_pack_mask(COMPACT *compact, BYTE *input_mask)
+{
+  int i;
+
+  memset(compact->mask, 0, 
+         ((compact->image_size + 63) / 64) * sizeof(*compact->mask));
+  for (i = 0; i < compact->image_size; i++)
+    if (input_mask[i] != 0)
+      compact->mask[i >> 6] |= 1ULL << (i & 63);
+}
+
+//a pixel has the reliability of calculate_reliability when it and its 8
+//neighbours are not masked, which is what extend_mask checks, and it is
+//not on a border which is not connected. The corners are never extended
+//by extend_mask. row and column are the indices of the neighbours.
+static int stencil_pixel(UNWRAP_CONTEXT *ctx, COMPACT *compact, int i, int j,
+                         int *row, int *column)
+{
+  int image_width = compact->image_width;
+  int image_height = compact->image_height;
+  int a, b;
+
+  if ((i == 0 || i == image_height - 1) && !ctx->y_connectivity) return 0;
+  if ((j == 0 || j == image_width - 1) && !ctx->x_connectivity) return 0;
+  if ((i == 0 || i == image_height - 1) && (j == 0 || j == image_width - 1))
+    return 0;
+  row[0] = (i == 0) ? image_height - 1 : i - 1;
+  row[1] = i;
+  row[2] = (i == image_height - 1) ? 0 : i + 1;
+  column[0] = (j == 0) ? image_width - 1 : j - 1;
+  column[1] = j;
+  column[2] = (j == image_width - 1) ? 0 : j + 1;
+  for (a = 0; a < 3; a++)
+    for (b = 0; b < 3; b++)
+      if (!MASK_BIT(compact->mask, row[a] * image_width + column[b]))
+        return 0;
+  return 1;
+}
+
+//the reliability of calculate_reliability, from the neighbours found by
+//stencil_pixel
+static float stencil_reliability(COMPACT *compact, int *row, int *column)
+{
+  int image_width = compact->image_width;
+  float *value = compact->value;
+  float centre, H, V, D1, D2;
+
+#define VALUE(a, b) value[row[a] * image_width + column[b]]
+  centre = VALUE(1, 1);
+  H = wrap(VALUE(1, 0) - centre) - wrap(centre - VALUE(1, 2));
+  V = wrap(VALUE(0, 1) - centre) - wrap(centre - VALUE(2, 1));
+  D1 = wrap(VALUE(0, 0) - centre) - wrap(centre - VALUE(2, 2));
+  D2 = wrap(VALUE(0, 2) - centre) - wrap(centre - VALUE(2, 0));
+#undef VALUE
+  return H*H + V*V + D1*D1 + D2*D2;
+}
+
+//the reliability of the pixel in row i and column j alone, for unwrapping
+//part of an image. The random reliability is drawn only when it is needed.
+float compact_pixel_reliability(UNWRAP_CONTEXT *ctx, COMPACT *compact,
+                                int i, int j)
+{
+  int row[3], column[3];
+
+  if (stencil_pixel(ctx, compact, i, j, row, column))
+    return stencil_reliability(compact, row, column);
+  return (float) (9999999.0 + rand_r(&ctx->seed));
+}
+
+//every pixel first gets the random reliability of initialisePIXELs, then
+//the pixels away from the borders are done a row at a time by the vector
+//kernel and the border pixels one by one
+static void compact_reliability(UNWRAP_CONTEXT *ctx, COMPACT *compact)
+{
+  int image_width = compact->image_width;
+  int image_height = compact->image_height;
+  float *value = compact->value;
+  float *reliability = compact->reliability;
+  RELIABILITY_ROW reliability_row = reliability_row_kernel(ctx->simd_level);
+  float *planned_row = context_workspace(ctx)->row_reliability;
+  float *row_reliability = (float *) workspace_buffer(planned_row,
+                                          image_width * sizeof(float), 0);
+  int i, j, row[3], column[3];
+
+  for (i = 0; i < image_height * image_width; i++)
+    reliability[i] = (float) (9999999.0 + rand_r(&ctx->seed));
+
+  for (i = 1; i < image_height - 1; i++)
+  {
+    float *centre_row = value + i * image_width + 1;
+    reliability_row(centre_row - image_width, centre_row, 
+                    centre_row + image_width, row_reliability, 
+                    image_width - 2);
+    for (j = 1; j < image_width - 1; j++)
+      if (stencil_pixel(ctx, compact, i, j, row, column))
+        reliability[i * image_width + j] = row_reliability[j - 1];
+  }
+  release_buffer(planned_row, row_reliability);
+
+  for (i = 0; i < image_height; i++)
+  {
+    for (j = 0; j < image_width; j++)
+    {
+      //skip from the left border to the right border away from the top
+      //and bottom rows
+      if (j == 1 && i > 0 && i < image_height - 1) j = image_width - 1;
+      if (!stencil_pixel(ctx, compact, i, j, row, column)) continue;
+      reliability[i * image_width + j] = stencil_reliability(compact, row,
+                                                             column);
+    }
+  }
+}
+
+//whether the edges of an image of image_size pixels can hold the index of
+//their first pixel shifted left by kind_bits
+int compact_fits(size_t image_size, int kind_bits)
+{
+  return image_size <= (UINT_MAX >> kind_bits);
+}
+
+//add the edge from pixel index to the neighbour of the given kind, if 
+//neither of the two pixels is masked
+void compact_add_edge(COMPACT *compact, int index, int kind)
+{
+  COMPACT_EDGE *edge = compact->edge + compact->No_of_edges;
+  unsigned int code = ((unsigned int) index << compact->kind_bits) | kind;
+  int second = SECOND_PIXEL(compact, code);
+
+  if (MASK_BIT(compact->mask, index) && MASK_BIT(compact->mask, second))
+  {
+    edge->reliab = compact->reliability[index] + compact->reliability[second];
+    edge->pixel = code;
+    compact->No_of_edges++;
+  }
+}
+
+//the edges are built in the same order as horizentalEDGEs and verticalEDGEs
+static void compact_edges(UNWRAP_CONTEXT *ctx, COMPACT *compact)
+{
+  int image_width = compact->image_width;
+  int image_height = compact->image_height;
+  int i, j;
+
+  compact->No_of_edges = 0;
+  for (i = 0; i < image_height; i++)
+    for (j = 0; j < image_width - 1; j++)
+      compact_add_edge(compact, i * image_width + j, RIGHT_NEIGHBOUR);
+  if (ctx->x_connectivity == 1)
+    for (i = 0; i < image_height; i++)
+      compact_add_edge(compact, i * image_width + image_width - 1, RIGHT_WRAPAROUND);
+  for (i = 0; i < image_height - 1; i++)
+    for (j = 0; j < image_width; j++)
+      compact_add_edge(compact, i * image_width + j, LOWER_NEIGHBOUR);
+  if (ctx->y_connectivity == 1)
+    for (j = 0; j < image_width; j++)
+      compact_add_edge(compact, (image_height - 1) * image_width + j, LOWER_WRAPAROUND);
+  ctx->No_of_edges = compact->No_of_edges;
+}
+
+//-----------------start in-place radix sort of the compact edges -------------
+//an MSD radix sort which permutes each digit into place (American flag
+//sort), on the same keys as radix_sort, finishing small buckets with an
+//insertion sort. Permuting is not stable, so the edges of equal
+//reliability are put in the order of their kinds, then of their first
+//pixels, by sorting on the code rotated by kind_bits below the key. The
+//layouts build their edges kind by kind with the first pixels in order,
+//so that is the order radix_sort keeps, and the pixels are gathered as
+//in the PIXELM layout.
+static unsigned int compact_key(COMPACT_EDGE *edge)
+{
+  unsigned int key;
+  memcpy(&key, &edge->reliab, sizeof(key));
+  return key ^ ((key & 0x80000000u) ? 0xffffffffu : 0x80000000u);
+}
+
+static unsigned int compact_rank(COMPACT_EDGE *edge, int kind_bits)
+{
+  if (kind_bits == 0) return edge->pixel;
+  return (edge->pixel >> kind_bits) | (edge->pixel << (32 - kind_bits));
+}
+
+//digit shift of the key, or of the rank below it once shift is below 32
+static ALWAYS_INLINE int compact_digit(COMPACT_EDGE *edge, int kind_bits,
+                                       int shift)
+{
+  if (shift >= 32) return (compact_key(edge) >> (shift - 32)) & 255;
+  return (compact_rank(edge, kind_bits) >> shift) & 255;
+}
+
+static int edge_before(COMPACT_EDGE *first, COMPACT_EDGE *second,
+                       int kind_bits)
+{
+  unsigned int key1 = compact_key(first), key2 = compact_key(second);
+
+  if (key1 != key2) return key1 < key2;
+  return compact_rank(first, kind_bits) < compact_rank(second, kind_bits);
+}
+
+static void insertion_sort_edges(COMPACT_EDGE *edge, int No_of_edges,
+                                 int kind_bits)
+{
+  int k, l;
+  COMPACT_EDGE current;
+
+  for (k = 1; k < No_of_edges; k++)
+  {
+    current = edge[k];
+    for (l = k; l > 0 && edge_before(&current, edge + l - 1, kind_bits); l--)
+      edge[l] = edge[l - 1];
+    edge[l] = current;
+  }
+}
+
+//sort the edges on digit shift of the key and rank and on those below it
+static void sort_digits(COMPACT_EDGE *edge, int No_of_edges, int kind_bits,
+                        int shift)
+{
+  int count[256], next[256], end[256];
+  int digit, k, total;
+  COMPACT_EDGE moving, swap_edge;
+
+  if (No_of_edges < 32)
+  {
+    insertion_sort_edges(edge, No_of_edges, kind_bits);
+    return;
+  }
+
+  memset(count, 0, sizeof(count));
+  for (k = 0; k < No_of_edges; k++)
+    count[compact_digit(edge + k, kind_bits, shift)]++;
+  total = 0;
+  for (digit = 0; digit < 256; digit++)
+  {
+    next[digit] = total;
+    total += count[digit];
+    end[digit] = total;
+  }
+
+  //move every edge into its bucket, following each cycle of moves
+  for (digit = 0; digit < 256; digit++)
+  {
+    while (next[digit] < end[digit])
+    {
+      moving = edge[next[digit]];
+      k = compact_digit(&moving, kind_bits, shift);
+      while (k != digit)
+      {
+        swap_edge = edge[next[k]];
+        edge[next[k]++] = moving;
+        moving = swap_edge;
+        k = compact_digit(&moving, kind_bits, shift);
+      }
+      edge[next[digit]++] = moving;
+    }
+  }
+
+  if (shift == 0) return;
+  total = 0;
+  for (digit = 0; digit < 256; digit++)
+  {
+    if (count[digit] > 1)
+      sort_digits(edge + total, count[digit], kind_bits, shift - 8);
+    total += count[digit];
+  }
+}
+
+//sort the edges by increasing reliability, in the order radix_sort gives
+//edges built kind by kind, with kind_bits bits of kind in their codes
+void compact_sort(COMPACT_EDGE *edge, int No_of_edges, int kind_bits)
+{
+  sort_digits(edge, No_of_edges, kind_bits, 56);
+}
+//-----------------end in-place radix sort of the compact edges ---------------
+
+//find the root of the group of pixel index as find_root does for PIXELMs
+int compact_root(COMPACT *compact, int index)
+{
+  int *parent = compact->parent;
+  int *increment = compact->increment;
+  int root = index;
+  int to_root = 0;
+  int next, step;
+
+  while (parent[root] >= 0)
+  {
+    to_root += increment[root];
+    root = parent[root];
+  }
+  while (parent[index] >= 0)
+  {
+    next = parent[index];
+    step = increment[index];
+    parent[index] = root;
+    increment[index] = to_root;
+    to_root -= step;
+    index = next;
+  }
+  return root;
+}
+
+//the merge of gatherPIXELs_union_find, with the group sizes kept as the
+//negative parent of the roots. Inlined with and without counting.
+static ALWAYS_INLINE void gather_compact(COMPACT *compact, const int counting)
+{
+  int *parent = compact->parent;
+  int *increment = compact->increment;
+  int k, index1, index2, root1, root2, edge_increment;
+  long No_of_merges = 0;
+  long No_of_relinked = 0;
+  COMPACT_EDGE *pointer_edge = compact->edge;
+
+  for (k = 0; k < compact->No_of_edges; k++, pointer_edge++)
+  {
+    index1 = (int) (pointer_edge->pixel >> compact->kind_bits);
+    index2 = SECOND_PIXEL(compact, pointer_edge->pixel);
+    root1 = compact_root(compact, index1);
+    root2 = compact_root(compact, index2);
+    if (root1 == root2) continue;
+
+    edge_increment = find_wrap(compact->value[index1], compact->value[index2]);
+    if (counting) No_of_merges++;
+    if (parent[root2] == -1)
+    {
+      if (counting) No_of_relinked++;
+      parent[root1]--;
+      parent[root2] = root1;
+      increment[root2] = increment[index1] - edge_increment;
+    }
+    else if (parent[root1] == -1)
+    {
+      if (counting) No_of_relinked++;
+      parent[root2]--;
+      parent[root1] = root2;
+      increment[root1] = increment[index2] + edge_increment;
+    }
+    else if (-parent[root1] > -parent[root2])
+    {
+      if (counting) No_of_relinked -= parent[root2];
+      parent[root1] += parent[root2];
+      parent[root2] = root1;
+      increment[root2] = increment[index1] - edge_increment - increment[index2];
+    }
+    else
+    {
+      if (counting) No_of_relinked -= parent[root1];
+      parent[root2] += parent[root1];
+      parent[root1] = root2;
+      increment[root1] = increment[index2] + edge_increment - increment[index1];
+    }
+  }
+  if (counting)
+  {
+    compact->stats->No_of_merges += No_of_merges;
+    compact->stats->No_of_relinked += No_of_relinked;
+  }
+}
+
+void compact_gather(COMPACT *compact)
+{
+  if (compact->stats != NULL)
+    gather_compact(compact, 1);
+  else
+    gather_compact(compact, 0);
+}
+
+//unwrapImage, maskImage and returnImage for the compact layout
+void compact_return(COMPACT *compact, float *UnwrappedImage)
+{
+  int image_size = compact->image_size;
+  float min = 99999999.;
+  int i;
+
+  for (i = 0; i < image_size; i++)
+  {
+    compact_root(compact, i);
+    UnwrappedImage[i] = compact->value[i] +
+                        TWOPI * (float) (compact->increment[i]);
+    if (UnwrappedImage[i] < min && MASK_BIT(compact->mask, i))
+      min = UnwrappedImage[i];
+  }
+  for (i = 0; i < image_size; i++)
+    if (!MASK_BIT(compact->mask, i))
+      UnwrappedImage[i] = min;
+}
+
+//No. of bytes phase_unwrap_2D_compact allocates for an n_pe x n_fe image
+size_t compact_workspace_size(int n_pe, int n_fe, int in_place)
+{
+  size_t image_size = (size_t) n_pe * n_fe;
+  size_t size = ((image_size + 63) / 64) * sizeof(unsigned long long) +
+                2 * image_size * sizeof(int) +
+                2 * image_size * sizeof(COMPACT_EDGE);
+  if (in_place) size += image_size * sizeof(float);
+  return size;
+}
+
+int phase_unwrap_2D_compact(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                            float* UnwrappedImage, BYTE* input_mask,
+                            int n_pe, int n_fe)
+{
+  return phase_unwrap_2D_compact_labels(ctx, WrappedImage, UnwrappedImage,
+                                        input_mask, n_pe, n_fe, NULL);
+}
+
+//as phase_unwrap_2D_compact, and if label is not NULL it is set to the
+//index of the root of the group of each pixel. Returns 0, having copied
+//the wrapped image, if the image is too large for compact_fits or there is
+//not enough memory.
+int phase_unwrap_2D_compact_labels(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                                   float* UnwrappedImage, BYTE* input_mask,
+                                   int n_pe, int n_fe, int *label)
+{
+  UNWRAP_WORKSPACE *workspace = context_workspace(ctx);
+  COMPACT compact;
+  float *own_reliability = NULL;
+  int image_size = n_pe * n_fe;
+  double start = 0;
+  int i;
+
+  if (!compact_fits((size_t) n_pe * n_fe, 2))
+  {
+    memmove(UnwrappedImage, WrappedImage, (size_t) n_pe * n_fe * sizeof(float));
+    return 0;
+  }
+  compact.value = WrappedImage;
+  compact.image_size = image_size;
+  compact.image_width = n_fe;
+  compact.image_height = n_pe;
+  compact.kind_bits = 2;
+  compact.neighbour[RIGHT_NEIGHBOUR] = 1;
+  compact.neighbour[LOWER_NEIGHBOUR] = n_fe;
+  compact.neighbour[RIGHT_WRAPAROUND] = 1 - n_fe;
+  compact.neighbour[LOWER_WRAPAROUND] = -n_fe * (n_pe - 1);
+  compact.stats = ctx->stats;
+  if (ctx->stats != NULL) start = unwrap_seconds();
+  //the unwrapped image is free until the end, unless it is the wrapped one
+  if (UnwrappedImage == WrappedImage)
+    own_reliability = (float *) workspace_buffer(workspace->reliability,
+                                                 image_size * sizeof(float), 0);
+  compact.reliability = own_reliability ? own_reliability : UnwrappedImage;
+  compact.mask = (unsigned long long *) workspace_buffer(workspace->mask_bits,
+    ((image_size + 63) / 64) * sizeof(unsigned long long), 0);
+  compact.parent = (int *) workspace_buffer(workspace->parent,
+                                            image_size * sizeof(int), 0);
+  compact.increment = (int *) workspace_buffer(workspace->increment,
+                                               image_size * sizeof(int), 0);
+  compact.edge = (COMPACT_EDGE *) workspace_buffer(workspace->compact_edge,
+                                    2 * image_size * sizeof(COMPACT_EDGE), 0);
+  if ((UnwrappedImage == WrappedImage && own_reliability == NULL) ||
+      compact.mask == NULL || compact.parent == NULL ||
+      compact.increment == NULL || compact.edge == NULL)
+  {
+    release_buffer(workspace->compact_edge, compact.edge);
+    release_buffer(workspace->increment, compact.increment);
+    release_buffer(workspace->parent, compact.parent);
+    release_buffer(workspace->mask_bits, compact.mask);
+    release_buffer(workspace->reliability, own_reliability);
+    memmove(UnwrappedImage, WrappedImage, image_size * sizeof(float));
+    return 0;
+  }
+
+  compact_pack_mask(&compact, input_mask);
+  STATS_LAP(ctx, mask_seconds, start);
+  compact_reliability(ctx, &compact);
+  STATS_LAP(ctx, reliability_seconds, start);
+  compact_edges(ctx, &compact);
+  STATS_LAP(ctx, edges_seconds, start);
+  compact_sort(compact.edge, compact.No_of_edges, compact.kind_bits);
+  STATS_LAP(ctx, sort_seconds, start);
+  for (i = 0; i < image_size; i++)
+  {
+    compact.parent[i] = -1;
+    compact.increment[i] = 0;
+  }
+  compact_gather(&compact);
+  STATS_LAP(ctx, merge_seconds, start);
+  compact_return(&compact, UnwrappedImage);
+  if (label != NULL)
+    for (i = 0; i < image_size; i++)
+      label[i] = (compact.parent[i] < 0) ? i : compact.parent[i];
+  STATS_LAP(ctx, return_seconds, start);
+
+  release_buffer(workspace->compact_edge, compact.edge);
+  release_buffer(workspace->increment, compact.increment);
+  release_buffer(workspace->parent, compact.parent);
+  release_buffer(workspace->mask_bits, compact.mask);
+  release_buffer(workspace->reliability, own_reliability);
+  return 1;
+}
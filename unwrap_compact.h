@@ -0,0 +1,42 @@
+#ifndef __UNWRAP_COMPACT
+#define __UNWRAP_COMPACT
+
+#include "Munther_2D_unwrap.h"
+
+//the state of an unwrap in the compact layout, shared by the 2D unwrapper
+//of unwrap_compact.c and the 3D unwrapper of Munther_3D_unwrap.c.
+//The pixel of an edge holds the index of its first pixel shifted left by
+//kind_bits, and the low kind_bits bits pick the offset in neighbour which
+//leads to the second pixel.
+struct COMPACT
+{
+  float *value;                   //the wrapped image
+  float *reliability;
+  int *parent;                    //-(No. of pixels in group) at the root
+  int *increment;                 //No. of 2*pi relative to the parent
+  unsigned long long *mask;       //1 where the pixel is not masked
+  COMPACT_EDGE *edge;
+  int No_of_edges;
+  int image_size;
+  int image_width;
+  int image_height;
+  int kind_bits;
+  int neighbour[8];               //index offset of the second pixel by kind
+  UNWRAP_STATS *stats;            //counts the merges if not NULL
+};
+
+typedef struct COMPACT COMPACT;
+
+#define SECOND_PIXEL(compact, code) \
+  ((int) ((code) >> (compact)->kind_bits) + \
+   (compact)->neighbour[(code) & ((1u << (compact)->kind_bits) - 1)])
+
+void compact_pack_mask(COMPACT *compact, BYTE *input_mask);
+float compact_pixel_reliability(UNWRAP_CONTEXT *ctx, COMPACT *compact,
+                                int i, int j);
+void compact_add_edge(COMPACT *compact, int index, int kind);
+int  compact_root(COMPACT *compact, int index);
+void compact_gather(COMPACT *compact);
+void compact_return(COMPACT *compact, float *UnwrappedImage);
+
+#endif
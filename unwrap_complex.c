@@ -0,0 +1,120 @@
+//The complex entry points of the unwrapper, which take an interferogram, a
+//complex image stored as pairs of (real, imaginary) values, and unwrap its
+//phase. The phase is computed by the phase kernels of unwrap_simd.c into
+//the unwrapped image, on the threads of the context, and the unwrapped
+//image is then unwrapped in place, so no image is allocated for the phase.
+//
+//The amplitude of the interferogram is not used, the reliabilities are
+//those of the phase alone.
+
+#include "Munther_2D_unwrap.h"
+#include "unwrap_threads.h"
+
+#include <math.h>
+
+//small chunks are not worth a thread
+#define PHASE_PIXELS 65536
+
+struct PHASE_CHUNKS
+{
+  const float *interferogram;
+  const double *interferogram_double;   //used if interferogram is NULL
+  float *phase;
+  double *phase_double;
+  PHASE_ROW kernel;
+  int image_width;
+  int image_height;
+  int n_chunks;
+};
+
+typedef struct PHASE_CHUNKS PHASE_CHUNKS;
+
+static void chunk_phase(void *chunks_pointer, int chunk)
+{
+  PHASE_CHUNKS *chunks = (PHASE_CHUNKS *) chunks_pointer;
+  long first = (long) chunks->image_height * chunk / chunks->n_chunks *
+               chunks->image_width;
+  long last = (long) chunks->image_height * (chunk + 1) / chunks->n_chunks *
+              chunks->image_width;
+  long k;
+
+  if (chunks->interferogram != NULL)
+    chunks->kernel(chunks->interferogram + 2 * first, chunks->phase + first,
+                   (int) (last - first));
+  else
+    for (k = first; k < last; k++)
+      chunks->phase_double[k] = atan2(chunks->interferogram_double[2 * k + 1],
+                                      chunks->interferogram_double[2 * k]);
+}
+
+//the phase of the interferogram, in chunks of rows on the threads of the
+//context. Returns the seconds taken if the context keeps stats.
+static double interferogram_phase(UNWRAP_CONTEXT *ctx, PHASE_CHUNKS *chunks,
+                                  int n_pe, int n_fe)
+{
+  int n_threads = (ctx->n_threads <= 0) ? unwrap_default_threads() :
+                                          ctx->n_threads;
+  long n_chunks = (long) n_pe * n_fe / PHASE_PIXELS + 1;
+  double start = 0;
+
+  if (ctx->stats != NULL) start = unwrap_seconds();
+  if (n_chunks > n_threads) n_chunks = n_threads;
+  if (n_chunks > n_pe) n_chunks = n_pe;
+  chunks->image_width = n_fe;
+  chunks->image_height = n_pe;
+  chunks->n_chunks = (int) n_chunks;
+  chunks->kernel = phase_row_kernel(ctx->simd_level);
+  run_parallel(chunks->n_chunks, chunks->n_chunks, chunk_phase, chunks);
+  return (ctx->stats != NULL) ? unwrap_seconds() - start : 0;
+}
+
+//add the time of the phase to the stats which the unwrapper filled in
+static void add_phase_seconds(UNWRAP_CONTEXT *ctx, double phase_seconds)
+{
+  if (ctx->stats == NULL) return;
+  ctx->stats->reliability_seconds += phase_seconds;
+  ctx->stats->total_seconds += phase_seconds;
+}
+
+//unwrap the phase of an interferogram of n_pe x n_fe complex floats.
+//Returns as phase_unwrap_2D_ctx does.
+int phase_unwrap_2D_complex(UNWRAP_CONTEXT *ctx, float* Interferogram,
+                            float* UnwrappedImage, BYTE* input_mask,
+                            int n_pe, int n_fe)
+{
+  PHASE_CHUNKS chunks;
+  double phase_seconds;
+  int unwrapped;
+
+  chunks.interferogram = Interferogram;
+  chunks.interferogram_double = NULL;
+  chunks.phase = UnwrappedImage;
+  chunks.phase_double = NULL;
+  phase_seconds = interferogram_phase(ctx, &chunks, n_pe, n_fe);
+  unwrapped = phase_unwrap_2D_ctx(ctx, UnwrappedImage, UnwrappedImage,
+                                  input_mask, n_pe, n_fe);
+  add_phase_seconds(ctx, phase_seconds);
+  return unwrapped;
+}
+
+//unwrap the phase of an interferogram of n_pe x n_fe complex doubles into
+//a double unwrapped image, as phase_unwrap_2D_double does. The phase is
+//computed with atan2 of the C library, as it is kept in double.
+int phase_unwrap_2D_complex_double(UNWRAP_CONTEXT *ctx, double* Interferogram,
+                                   double* UnwrappedImage, BYTE* input_mask,
+                                   int n_pe, int n_fe)
+{
+  PHASE_CHUNKS chunks;
+  double phase_seconds;
+  int unwrapped;
+
+  chunks.interferogram = NULL;
+  chunks.interferogram_double = Interferogram;
+  chunks.phase = NULL;
+  chunks.phase_double = UnwrappedImage;
+  phase_seconds = interferogram_phase(ctx, &chunks, n_pe, n_fe);
+  unwrapped = phase_unwrap_2D_double(ctx, UnwrappedImage, UnwrappedImage,
+                                     input_mask, n_pe, n_fe);
+  add_phase_seconds(ctx, phase_seconds);
+  return unwrapped;
+}
@@ -0,0 +1,125 @@
+//The double precision entry points of the unwrapper. The reliabilities,
+//the edges and the merges only need the wrapped phase to a few digits, so
+//they stay in float, but the unwrapped phase is written in double: the
+//float unwrapper gives the No. of 2*pi of every pixel, which is
+//rint((unwrapped - wrapped) / 2*pi) of its float values, and the double
+//unwrapped phase is the wrapped phase plus that many 2*pi, added in
+//double. An image which spans thousands of cycles so keeps the digits of
+//its wrapped phase, where the float unwrapper would round the sum to the
+//float spacing of the unwrapped value.
+//
+//phase_unwrap_2D_double takes a double wrapped phase and
+//phase_unwrap_2D_mixed a float one. Neither needs a buffer of its own
+//unless it unwraps in place: the float images of the unwrapper are put in
+//the first half of the double unwrapped image, which is widened from the
+//end so that every float is read before it is written over.
+
+#include "Munther_2D_unwrap.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static float TWOPI = 6.283185307;
+static double TWOPI_DOUBLE = 6.283185307179586;
+
+//the double unwrapped phase of a pixel of the float unwrapper
+#define WIDEN(wrapped, wrapped_float, unwrapped_float) \
+  ((wrapped) + TWOPI_DOUBLE * rint(((unwrapped_float) - (wrapped_float)) / \
+                                   TWOPI))
+
+//widen the float unwrapped image into the double unwrapped image, from
+//the end, and set the masked pixels to the minimum as maskImage does.
+//Either wrapped_double or wrapped_float is NULL. If unwrapped is 0 the
+//float unwrapper did nothing and the wrapped phase is copied.
+static void widen_image(double *wrapped_double, float *wrapped_float,
+                        float *UnwrappedFloat, double *UnwrappedImage,
+                        BYTE *input_mask, int image_size, int unwrapped)
+{
+  double min = 99999999.;
+  double value;
+  float wrapped;
+  int k;
+
+  for (k = image_size - 1; k >= 0; k--)
+  {
+    wrapped = (wrapped_double != NULL) ? (float) wrapped_double[k] :
+                                         wrapped_float[k];
+    value = (wrapped_double != NULL) ? wrapped_double[k] : wrapped;
+    if (unwrapped)
+      value = WIDEN(value, wrapped, UnwrappedFloat[k]);
+    UnwrappedImage[k] = value;
+    if ((input_mask == NULL || input_mask[k] != 0) && value < min)
+      min = value;
+  }
+  if (!unwrapped || input_mask == NULL) return;
+  for (k = 0; k < image_size; k++)
+    if (input_mask[k] == 0) UnwrappedImage[k] = min;
+}
+
+//add the time of the narrowing and the widening to the stats which
+//phase_unwrap_2D_ctx filled in
+static void add_stats(UNWRAP_CONTEXT *ctx, double narrow_seconds,
+                      double start)
+{
+  double widen_seconds = unwrap_seconds() - start;
+
+  ctx->stats->reliability_seconds += narrow_seconds;
+  ctx->stats->return_seconds += widen_seconds;
+  ctx->stats->total_seconds += narrow_seconds + widen_seconds;
+}
+
+//unwrap a double wrapped phase into a double unwrapped phase, which may be
+//the same array. Returns as phase_unwrap_2D_ctx does, or 0, having
+//unwrapped nothing, if there is not enough memory.
+int phase_unwrap_2D_double(UNWRAP_CONTEXT *ctx, double *WrappedImage,
+                           double *UnwrappedImage, BYTE *input_mask,
+                           int n_pe, int n_fe)
+{
+  int image_size = n_pe * n_fe;
+  float *buffer = NULL;
+  float *image;
+  double start = 0, narrow_seconds = 0;
+  int k, unwrapped;
+
+  if (ctx->stats != NULL) start = unwrap_seconds();
+  if (UnwrappedImage == WrappedImage)
+  {
+    buffer = (float *) malloc(image_size * sizeof(float));
+    if (buffer == NULL) return 0;
+    image = buffer;
+  }
+  else
+    image = (float *) UnwrappedImage;
+  for (k = 0; k < image_size; k++)
+    image[k] = (float) WrappedImage[k];
+  if (ctx->stats != NULL) narrow_seconds = unwrap_seconds() - start;
+
+  unwrapped = phase_unwrap_2D_ctx(ctx, image, image, input_mask, n_pe, n_fe);
+
+  if (ctx->stats != NULL) start = unwrap_seconds();
+  widen_image(WrappedImage, NULL, image, UnwrappedImage, input_mask,
+              image_size, unwrapped);
+  if (ctx->stats != NULL) add_stats(ctx, narrow_seconds, start);
+  free(buffer);
+  return unwrapped;
+}
+
+//unwrap a float wrapped phase into a double unwrapped phase, the mixed
+//precision of the unwrapper. The two images must not overlap. Returns as
+//phase_unwrap_2D_ctx does.
+int phase_unwrap_2D_mixed(UNWRAP_CONTEXT *ctx, float *WrappedImage,
+                          double *UnwrappedImage, BYTE *input_mask,
+                          int n_pe, int n_fe)
+{
+  float *image = (float *) UnwrappedImage;
+  double start = 0;
+  int unwrapped;
+
+  unwrapped = phase_unwrap_2D_ctx(ctx, WrappedImage, image, input_mask,
+                                  n_pe, n_fe);
+  if (ctx->stats != NULL) start = unwrap_seconds();
+  widen_image(NULL, WrappedImage, image, UnwrappedImage, input_mask,
+              n_pe * n_fe, unwrapped);
+  if (ctx->stats != NULL) add_stats(ctx, 0, start);
+  return unwrapped;
+}
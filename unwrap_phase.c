@@ -3,65 +3,643 @@
 #include <Python.h>
 #include "numpy/noprefix.h"
 #include "Munther_2D_unwrap.h"
+#include "Munther_3D_unwrap.h"
+#include "unwrap_tiled.h"
 
-static char doc_Unwrap2D[] = "Performs 2D phase unwrapping on a ndarray object; accepts a binary mask";
+static char doc_Unwrap2D[] = "Performs 2D phase unwrapping on a float32 or float64 ndarray object, or on the phase of a complex64 or complex128 one; accepts a uint8 or bool mask (nonzero at good points) or None, an optional output array to write into (float64 for float64 phase and complex128, float32 for complex64, float32 or float64 for float32 phase, where float64 adds the whole cycles in double precision, or int8 or int16 for float32 phase to write the number of whole cycles of each pixel instead), an optional dict to fill with the time of each stage and the counts of edges, merges and groups, an optional number of buckets, an optional (axis 0, axis 1) tuple of wraparound flags ((-1, -1) for the default), an optional C-contiguous float32 quality map (lower is more reliable) to unwrap in the order of, and an optional C-contiguous float32 array to fill with the reliability of each pixel";
+
+/* puts the stats of an unwrap into dict; returns -1 if that failed */
+static int stats_to_dict(PyObject *dict, UNWRAP_STATS *stats) {
+  struct {const char *name; double value;} seconds[] = {
+    {"mask_seconds", stats->mask_seconds},
+    {"reliability_seconds", stats->reliability_seconds},
+    {"edges_seconds", stats->edges_seconds},
+    {"sort_seconds", stats->sort_seconds},
+    {"merge_seconds", stats->merge_seconds},
+    {"return_seconds", stats->return_seconds},
+    {"total_seconds", stats->total_seconds}};
+  struct {const char *name; long value;} counts[] = {
+    {"edges", stats->No_of_edges},
+    {"merges", stats->No_of_merges},
+    {"relinked", stats->No_of_relinked},
+    {"groups", stats->No_of_groups}};
+  PyObject *value;
+  int i, status;
+
+  for(i = 0; i < (int)(sizeof(seconds)/sizeof(seconds[0])); i++) {
+    if((value = PyFloat_FromDouble(seconds[i].value)) == NULL) return -1;
+    status = PyDict_SetItemString(dict, seconds[i].name, value);
+    Py_DECREF(value);
+    if(status < 0) return -1;
+  }
+  for(i = 0; i < (int)(sizeof(counts)/sizeof(counts[0])); i++) {
+    if((value = PyInt_FromLong(counts[i].value)) == NULL) return -1;
+    status = PyDict_SetItemString(dict, counts[i].name, value);
+    Py_DECREF(value);
+    if(status < 0) return -1;
+  }
+  return 0;
+}
+
+/* 1 if op is a C-contiguous float32 array of the 2 dims */
+static int is_float_image(PyObject *op, npy_intp *dims) {
+  return PyArray_Check(op) && PyArray_TYPE(op) == PyArray_FLOAT &&
+         PyArray_ISCARRAY(op) && PyArray_NDIM(op) == 2 &&
+         PyArray_DIMS(op)[0] == dims[0] && PyArray_DIMS(op)[1] == dims[1];
+}
+
+/* the default context, with the borders connected as the wraparound flags
+   say if they are given (0 or more) */
+static void wrap_context(UNWRAP_CONTEXT *ctx, int wrap_y, int wrap_x) {
+  initialise_unwrap_context(ctx);
+  if(wrap_y >= 0) {
+    ctx->y_connectivity = wrap_y != 0;
+    ctx->x_connectivity = wrap_x != 0;
+  }
+}
 
 PyObject *punwrap2D_Unwrap2D(PyObject *self, PyObject *args) {
+  PyObject *op1, *op2, *op3 = Py_None, *op4 = Py_None;
+  PyObject *op5 = Py_None, *op6 = Py_None;
+  PyArrayObject *phsArray, *mskArray = NULL, *retArray;
+  int buckets = 0;
+  int wrap_y = -1, wrap_x = -1;
+  void *wr_phs, *uw_phs;
+  BYTE *bmask = NULL;
+  int typenum_phs, typenum_msk, typenum_ret, ndim;
+  npy_intp *dims;
+  PyArray_Descr *dtype_phs;
+  UNWRAP_CONTEXT ctx;
+  UNWRAP_STATS stats;
+
+  if(!PyArg_ParseTuple(args, "OO|OOi(ii)OO", &op1, &op2, &op3, &op4, &buckets,
+                       &wrap_y, &wrap_x, &op5, &op6)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2D: Couldn't parse the arguments");
+    return NULL;
+  }
+  if(op1==NULL || op2==NULL) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2D: Arguments not read correctly");
+    return NULL;
+  }
+  
+  typenum_phs = PyArray_TYPE(op1);
+  ndim = PyArray_NDIM(op1);
+  dims = PyArray_DIMS(op1);
+  /* This stuff is technically enforced in punwrap/__init__.py */
+  if(typenum_phs != PyArray_FLOAT && typenum_phs != PyArray_DOUBLE &&
+     typenum_phs != PyArray_CFLOAT && typenum_phs != PyArray_CDOUBLE) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2D: I can only handle single or double-precision floating point or complex numbers");
+    return NULL;
+  }
+  if(ndim != 2) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2D: I can only unwrap 2D arrays");
+    return NULL;
+  }
+  if(op2 != Py_None) {
+    /* a bool is one byte, 0 or 1, so both are used as they are */
+    typenum_msk = PyArray_TYPE(op2);
+    if(typenum_msk != PyArray_UBYTE && typenum_msk != PyArray_BOOL) {
+      PyErr_SetString(PyExc_Exception, "Unwrap2D: The mask should be type uint8 or bool");
+      return NULL;
+    }
+    if(PyArray_NDIM(op2) != 2 || PyArray_DIMS(op2)[0] != dims[0] ||
+       PyArray_DIMS(op2)[1] != dims[1]) {
+      PyErr_SetString(PyExc_Exception, "Unwrap2D: The mask should match the array");
+      return NULL;
+    }
+  }
+  /* the unwrapped phase is as precise as the wrapped phase or the complex
+     numbers, or double, or it is the wrap counts of the float unwrapper */
+  if(typenum_phs == PyArray_CFLOAT) typenum_ret = PyArray_FLOAT;
+  else if(typenum_phs == PyArray_CDOUBLE) typenum_ret = PyArray_DOUBLE;
+  else typenum_ret = typenum_phs;
+  if(op3 != Py_None) {
+    if(!PyArray_Check(op3) || (PyArray_TYPE(op3) != typenum_ret &&
+       (typenum_phs != PyArray_FLOAT || (PyArray_TYPE(op3) != PyArray_DOUBLE &&
+                                         PyArray_TYPE(op3) != PyArray_BYTE &&
+                                         PyArray_TYPE(op3) != PyArray_SHORT))) ||
+       !PyArray_ISCARRAY(op3) || PyArray_NDIM(op3) != 2 ||
+       PyArray_DIMS(op3)[0] != dims[0] || PyArray_DIMS(op3)[1] != dims[1]) {
+      PyErr_SetString(PyExc_Exception, "Unwrap2D: out should be a C-contiguous array of the shape of the phase, float64 for float64 phase and complex128, float32 for complex64, and float32, float64, int8 or int16 for float32 phase");
+      return NULL;
+    }
+    typenum_ret = PyArray_TYPE(op3);
+  }
+  if(op4 != Py_None && !PyDict_Check(op4)) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2D: stats should be a dict");
+    return NULL;
+  }
+  if(buckets < 0) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2D: buckets should be 0 or more");
+    return NULL;
+  }
+  /* the quality map is read and the reliability map written in place */
+  if((op5 != Py_None && !is_float_image(op5, dims)) ||
+     (op6 != Py_None && !is_float_image(op6, dims))) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2D: the quality and reliability maps should be C-contiguous float32 arrays of the shape of the phase");
+    return NULL;
+  }
+
+  /* increasing references here; nothing is copied for C-contiguous input */
+  phsArray = (PyArrayObject *)PyArray_FROM_OTF(op1, typenum_phs, NPY_IN_ARRAY);
+  if(phsArray == NULL) return NULL;
+  if(op2 != Py_None) {
+    mskArray = (PyArrayObject *)PyArray_FROM_OTF(op2, typenum_msk, NPY_IN_ARRAY);
+    if(mskArray == NULL) {
+      Py_DECREF(phsArray);
+      return NULL;
+    }
+    bmask = (BYTE *)PyArray_DATA(mskArray);
+  }
+  if(op3 != Py_None) {
+    Py_INCREF(op3);
+    retArray = (PyArrayObject *)op3;
+  }
+  else {
+    /* create a new, empty ndarray with floats */
+    dtype_phs = PyArray_DescrFromType(typenum_ret);
+    retArray = (PyArrayObject *)PyArray_SimpleNewFromDescr(ndim, dims, dtype_phs);
+    if(retArray == NULL) {
+      Py_DECREF(phsArray);
+      Py_XDECREF(mskArray);
+      return NULL;
+    }
+  }
+  wr_phs = PyArray_DATA(phsArray);
+  uw_phs = PyArray_DATA(retArray);
+
+  wrap_context(&ctx, wrap_y, wrap_x);
+  /* the stats are only gathered when they are asked for */
+  if(op4 != Py_None) ctx.stats = &stats;
+  /* 0 buckets sorts the edges exactly */
+  if(buckets > 0) {
+    ctx.sort_method = BUCKET_SORT;
+    ctx.n_buckets = buckets;
+  }
+  if(op5 != Py_None) ctx.quality = (float *)PyArray_DATA(op5);
+  if(op6 != Py_None) ctx.reliability_map = (float *)PyArray_DATA(op6);
+  Py_BEGIN_ALLOW_THREADS
+  if(typenum_phs == PyArray_CFLOAT)
+    phase_unwrap_2D_complex(&ctx, (float *)wr_phs, (float *)uw_phs, bmask,
+                            (int) dims[0], (int) dims[1]);
+  else if(typenum_phs == PyArray_CDOUBLE)
+    phase_unwrap_2D_complex_double(&ctx, (double *)wr_phs, (double *)uw_phs,
+                                   bmask, (int) dims[0], (int) dims[1]);
+  else if(typenum_phs == PyArray_DOUBLE)
+    phase_unwrap_2D_double(&ctx, (double *)wr_phs, (double *)uw_phs, bmask,
+                           (int) dims[0], (int) dims[1]);
+  else if(typenum_ret == PyArray_DOUBLE)
+    phase_unwrap_2D_mixed(&ctx, (float *)wr_phs, (double *)uw_phs, bmask,
+                          (int) dims[0], (int) dims[1]);
+  else if(typenum_ret != PyArray_FLOAT)
+    phase_unwrap_2D_counts(&ctx, (float *)wr_phs, uw_phs,
+                           typenum_ret == PyArray_BYTE ? WRAP_COUNT_INT8 :
+                                                         WRAP_COUNT_INT16,
+                           bmask, (int) dims[0], (int) dims[1]);
+  else
+    phase_unwrap_2D_ctx(&ctx, (float *)wr_phs, (float *)uw_phs, bmask,
+                        (int) dims[0], (int) dims[1]);
+  Py_END_ALLOW_THREADS
+
+  Py_DECREF(phsArray);
+  Py_XDECREF(mskArray);
+  if(op4 != Py_None && stats_to_dict(op4, &stats) < 0) {
+    Py_DECREF(retArray);
+    return NULL;
+  }
+  return PyArray_Return(retArray);
+    
+}
+
+static char doc_Unwrap2DStack[] = "Performs 2D phase unwrapping on every slice of a (N, H, W) ndarray object on a pool of threads; accepts a (N, H, W) or (H, W) binary mask and an optional number of threads";
+
+PyObject *punwrap2D_Unwrap2DStack(PyObject *self, PyObject *args) {
+  PyObject *op1, *op2;
+  PyArrayObject *phsArray, *mskArray, *retArray;
+  float *wr_phs, *uw_phs;
+  BYTE *bmask;
+  int typenum_phs, typenum_msk, ndim, ndim_msk, mask_stride;
+  int nthreads = 0;
+  npy_intp *dims, *dims_msk;
+  PyArray_Descr *dtype_phs;
+
+  if(!PyArg_ParseTuple(args, "OO|i", &op1, &op2, &nthreads)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2DStack: Couldn't parse the arguments");
+    return NULL;
+  }
+  if(op1==NULL || op2==NULL) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2DStack: Arguments not read correctly");
+    return NULL;
+  }
+
+  typenum_phs = PyArray_TYPE(op1);
+  typenum_msk = PyArray_TYPE(op2);
+  ndim = PyArray_NDIM(op1);
+  ndim_msk = PyArray_NDIM(op2);
+  dims = PyArray_DIMS(op1);
+  dims_msk = PyArray_DIMS(op2);
+  /* This stuff is technically enforced in punwrap/__init__.py */
+  if(typenum_phs != PyArray_FLOAT) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DStack: I can only handle single-precision floating point numbers");
+    return NULL;
+  }
+  if(typenum_msk != PyArray_UBYTE) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DStack: The mask should be type uint8");
+    return NULL;
+  }
+  if(ndim != 3) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DStack: I can only unwrap 3D stacks of 2D arrays");
+    return NULL;
+  }
+  if(ndim_msk == 3 && dims_msk[0] == dims[0] && dims_msk[1] == dims[1] && 
+     dims_msk[2] == dims[2]) {
+    mask_stride = (int) (dims[1] * dims[2]);
+  } else if(ndim_msk == 2 && dims_msk[0] == dims[1] && dims_msk[1] == dims[2]) {
+    mask_stride = 0;
+  } else {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DStack: The mask should match either the stack or a single slice");
+    return NULL;
+  }
+
+  dtype_phs = PyArray_DescrFromType(typenum_phs);
+  /* increasing references here */
+  phsArray = (PyArrayObject *)PyArray_FROM_OTF(op1, typenum_phs, NPY_IN_ARRAY);
+  if(phsArray == NULL) return NULL;
+  mskArray = (PyArrayObject *)PyArray_FROM_OTF(op2, typenum_msk, NPY_IN_ARRAY);
+  if(mskArray == NULL) {
+    Py_DECREF(phsArray);
+    return NULL;
+  }
+  /* one output array for the whole stack */
+  retArray = (PyArrayObject *)PyArray_SimpleNewFromDescr(ndim, dims, dtype_phs);
+  if(retArray == NULL) {
+    Py_DECREF(phsArray);
+    Py_DECREF(mskArray);
+    return NULL;
+  }
+  wr_phs = (float *)PyArray_DATA(phsArray);
+  uw_phs = (float *)PyArray_DATA(retArray);
+  bmask = (BYTE *)PyArray_DATA(mskArray);
+
+  /* the slices are unwrapped on worker threads which never call back into
+     python, so other python threads can run meanwhile */
+  Py_BEGIN_ALLOW_THREADS
+  phase_unwrap_2D_stack(wr_phs, uw_phs, bmask, mask_stride, (int) dims[0],
+                        (int) dims[1], (int) dims[2], nthreads);
+  Py_END_ALLOW_THREADS
+
+  Py_DECREF(phsArray);
+  Py_DECREF(mskArray);
+  return PyArray_Return(retArray);
+}
+
+static char doc_Unwrap3D[] = "Performs 3D phase unwrapping on a ndarray object; accepts a binary mask and an optional (axis 0, axis 1, axis 2) tuple of wraparound flags";
+
+PyObject *punwrap2D_Unwrap3D(PyObject *self, PyObject *args) {
   PyObject *op1, *op2;
   PyArrayObject *phsArray, *mskArray, *retArray;
   float *wr_phs, *uw_phs;
   BYTE *bmask;
   int typenum_phs, typenum_msk, ndim;
-  npy_intp *dims;
+  int wrap_z = -1, wrap_y = -1, wrap_x = -1;
+  npy_intp *dims, *dims_msk;
   PyArray_Descr *dtype_phs;
+  UNWRAP_CONTEXT ctx;
 
-  if(!PyArg_ParseTuple(args, "OO", &op1, &op2)) {
-    PyErr_SetString(PyExc_Exception,"Unwrap2D: Couldn't parse the arguments");
+  if(!PyArg_ParseTuple(args, "OO|(iii)", &op1, &op2, &wrap_z, &wrap_y, &wrap_x)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap3D: Couldn't parse the arguments");
     return NULL;
   }
   if(op1==NULL || op2==NULL) {
-    PyErr_SetString(PyExc_Exception,"Unwrap2D: Arguments not read correctly");
+    PyErr_SetString(PyExc_Exception,"Unwrap3D: Arguments not read correctly");
     return NULL;
   }
-  
+
   typenum_phs = PyArray_TYPE(op1);
   typenum_msk = PyArray_TYPE(op2);
   ndim = PyArray_NDIM(op1);
-  dims = PyArray_DIMS(op2);
+  dims = PyArray_DIMS(op1);
+  dims_msk = PyArray_DIMS(op2);
   /* This stuff is technically enforced in punwrap/__init__.py */
   if(typenum_phs != PyArray_FLOAT) {
-    PyErr_SetString(PyExc_Exception, "Unwrap2D: I can only handle single-precision floating point numbers");
+    PyErr_SetString(PyExc_Exception, "Unwrap3D: I can only handle single-precision floating point numbers");
     return NULL;
   }
   if(typenum_msk != PyArray_UBYTE) {
-    PyErr_SetString(PyExc_Exception, "Unwrap2D: The mask should be type uint8");
+    PyErr_SetString(PyExc_Exception, "Unwrap3D: The mask should be type uint8");
     return NULL;
   }
-  if(ndim != 2) {
-    PyErr_SetString(PyExc_Exception, "Unwrap2D: I can only unwrap 2D arrays");
+  if(ndim != 3) {
+    PyErr_SetString(PyExc_Exception, "Unwrap3D: I can only unwrap 3D arrays");
+    return NULL;
+  }
+  if(PyArray_NDIM(op2) != 3 || dims_msk[0] != dims[0] || 
+     dims_msk[1] != dims[1] || dims_msk[2] != dims[2]) {
+    PyErr_SetString(PyExc_Exception, "Unwrap3D: The mask should match the array");
     return NULL;
   }
 
+  initialise_unwrap_context(&ctx);
+  if(wrap_z >= 0) {
+    ctx.z_connectivity = wrap_z != 0;
+    ctx.y_connectivity = wrap_y != 0;
+    ctx.x_connectivity = wrap_x != 0;
+  }
+
   dtype_phs = PyArray_DescrFromType(typenum_phs);
   /* increasing references here */
   phsArray = (PyArrayObject *)PyArray_FROM_OTF(op1, typenum_phs, NPY_IN_ARRAY);
+  if(phsArray == NULL) return NULL;
   mskArray = (PyArrayObject *)PyArray_FROM_OTF(op2, typenum_msk, NPY_IN_ARRAY);
+  if(mskArray == NULL) {
+    Py_DECREF(phsArray);
+    return NULL;
+  }
   /* create a new, empty ndarray with floats */
   retArray = (PyArrayObject *)PyArray_SimpleNewFromDescr(ndim, dims, dtype_phs);
+  if(retArray == NULL) {
+    Py_DECREF(phsArray);
+    Py_DECREF(mskArray);
+    return NULL;
+  }
   wr_phs = (float *)PyArray_DATA(phsArray);
   uw_phs = (float *)PyArray_DATA(retArray);
   bmask = (BYTE *)PyArray_DATA(mskArray);
 
-  phase_unwrap_2D(wr_phs, uw_phs, bmask, (int) dims[0], (int) dims[1]);
+  Py_BEGIN_ALLOW_THREADS
+  phase_unwrap_3D_ctx(&ctx, wr_phs, uw_phs, bmask, (int) dims[0], 
+                      (int) dims[1], (int) dims[2]);
+  Py_END_ALLOW_THREADS
 
   Py_DECREF(phsArray);
   Py_DECREF(mskArray);
   return PyArray_Return(retArray);
-    
+}
+
+static char doc_Unwrap2DTiled[] = "Unwraps a 2D float32 image held in a raw file tile by tile, writing a raw float32 file, which is only replaced once the unwrap has succeeded; accepts the shape, an optional raw uint8 mask file, the tile size and the number of threads";
+
+PyObject *punwrap2D_Unwrap2DTiled(PyObject *self, PyObject *args) {
+  const char *wrapped_file, *unwrapped_file, *mask_file = NULL;
+  long n_pe, n_fe;
+  int tile_size = 1024, n_threads = 0, result;
+  UNWRAP_CONTEXT ctx;
+
+  if(!PyArg_ParseTuple(args, "ss(ll)|zii", &wrapped_file, &unwrapped_file,
+                       &n_pe, &n_fe, &mask_file, &tile_size, &n_threads)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2DTiled: Couldn't parse the arguments");
+    return NULL;
+  }
+  if(n_pe < 1 || n_fe < 1 || tile_size < 1) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DTiled: The shape and the tile size should be positive");
+    return NULL;
+  }
+
+  initialise_unwrap_context(&ctx);
+  ctx.n_threads = n_threads;
+
+  Py_BEGIN_ALLOW_THREADS
+  result = phase_unwrap_2D_tiled_files(&ctx, wrapped_file, unwrapped_file,
+                                       mask_file, n_pe, n_fe, tile_size);
+  Py_END_ALLOW_THREADS
+
+  if(!result) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DTiled: Couldn't map the files, the output is an input file, or ran out of memory");
+    return NULL;
+  }
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static char doc_Unwrap2DPlanCreate[] = "Makes a plan for unwrapping 2D arrays of the given (rows, columns) shape, which reuses its buffers for every array; accepts an optional (axis 0, axis 1) tuple of wraparound flags";
+
+static void punwrap2D_destroy_plan(PyObject *capsule) {
+  unwrap_plan_destroy((UNWRAP_PLAN *)PyCapsule_GetPointer(capsule, "punwrap2D.plan"));
+}
+
+PyObject *punwrap2D_Unwrap2DPlanCreate(PyObject *self, PyObject *args) {
+  int n_pe, n_fe;
+  int wrap_y = -1, wrap_x = -1;
+  UNWRAP_CONTEXT ctx;
+  UNWRAP_PLAN *plan;
+
+  if(!PyArg_ParseTuple(args, "(ii)|(ii)", &n_pe, &n_fe, &wrap_y, &wrap_x)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2DPlanCreate: Couldn't parse the arguments");
+    return NULL;
+  }
+  if(n_pe < 1 || n_fe < 1) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DPlanCreate: The shape should be positive");
+    return NULL;
+  }
+  wrap_context(&ctx, wrap_y, wrap_x);
+  plan = unwrap_plan_create(&ctx, n_pe, n_fe);
+  if(plan == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  return PyCapsule_New(plan, "punwrap2D.plan", punwrap2D_destroy_plan);
+}
+
+/* an array the plan can use as it is, without a copy */
+static int plan_array(PyObject *op, int typenum, int writeable, UNWRAP_PLAN *plan) {
+  return PyArray_Check(op) && PyArray_TYPE(op) == typenum &&
+    (writeable ? PyArray_ISCARRAY(op) : PyArray_ISCARRAY_RO(op)) &&
+    PyArray_NDIM(op) == 2 &&
+    PyArray_DIMS(op)[0] == plan->n_pe && PyArray_DIMS(op)[1] == plan->n_fe;
+}
+
+/* marks the plan or stream of a capsule as busy for a call which releases
+   the GIL, so that another thread cannot use its buffers at the same time;
+   the capsule context is only set while a call is running. The GIL is held
+   here, so the test and the mark cannot be split. */
+static int capsule_acquire(PyObject *capsule, const char *message) {
+  if(PyCapsule_GetContext(capsule) != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, message);
+    return 0;
+  }
+  return PyCapsule_SetContext(capsule, capsule) == 0;
+}
+
+static void capsule_release(PyObject *capsule) {
+  PyCapsule_SetContext(capsule, NULL);
+}
+
+static char doc_Unwrap2DPlan[] = "Unwraps a 2D float32 array with a plan into a float32 array of the same shape; accepts a uint8 or bool mask or None. Nothing is copied or allocated";
+
+PyObject *punwrap2D_Unwrap2DPlan(PyObject *self, PyObject *args) {
+  PyObject *capsule, *op1, *op2, *op3;
+  UNWRAP_PLAN *plan;
+  BYTE *bmask = NULL;
+
+  if(!PyArg_ParseTuple(args, "OOOO", &capsule, &op1, &op2, &op3)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2DPlan: Couldn't parse the arguments");
+    return NULL;
+  }
+  plan = (UNWRAP_PLAN *)PyCapsule_GetPointer(capsule, "punwrap2D.plan");
+  if(plan == NULL) return NULL;
+  if(!plan_array(op1, PyArray_FLOAT, 0, plan) || !plan_array(op3, PyArray_FLOAT, 1, plan)) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DPlan: The phase and the output should be C-contiguous float32 arrays of the shape of the plan");
+    return NULL;
+  }
+  if(op2 != Py_None) {
+    if(!plan_array(op2, PyArray_UBYTE, 0, plan) && !plan_array(op2, PyArray_BOOL, 0, plan)) {
+      PyErr_SetString(PyExc_Exception, "Unwrap2DPlan: The mask should be a C-contiguous uint8 or bool array of the shape of the plan");
+      return NULL;
+    }
+    bmask = (BYTE *)PyArray_DATA(op2);
+  }
+  if(!capsule_acquire(capsule, "Unwrap2DPlan: The plan is being used by another thread"))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  phase_unwrap_2D_plan(plan, (float *)PyArray_DATA(op1), 
+                       (float *)PyArray_DATA(op3), bmask);
+  Py_END_ALLOW_THREADS
+  capsule_release(capsule);
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static char doc_Unwrap2DPyramid[] = "Unwraps a 2D float32 array coarse to fine through a pyramid of downsampled levels into a float32 array of the same shape; accepts a uint8 or bool mask or None, an optional dict to fill with the stats of the finest level and its No. of re-resolved pixels (0 if it was unwrapped in full), an optional number of levels (-1 to choose it from the size) and an optional (axis 0, axis 1) tuple of wraparound flags";
+
+PyObject *punwrap2D_Unwrap2DPyramid(PyObject *self, PyObject *args) {
+  PyObject *op1, *op2, *op3, *op4 = Py_None, *value;
+  int levels = -1;
+  int wrap_y = -1, wrap_x = -1;
+  npy_intp *dims;
+  BYTE *bmask = NULL;
+  UNWRAP_CONTEXT ctx;
+  UNWRAP_STATS stats;
+
+  if(!PyArg_ParseTuple(args, "OOO|Oi(ii)", &op1, &op2, &op3, &op4, &levels,
+                       &wrap_y, &wrap_x)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2DPyramid: Couldn't parse the arguments");
+    return NULL;
+  }
+  if(!PyArray_Check(op1) || !is_float_image(op1, PyArray_DIMS(op1)) ||
+     !is_float_image(op3, PyArray_DIMS(op1))) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DPyramid: The phase and the output should be C-contiguous 2D float32 arrays of the same shape");
+    return NULL;
+  }
+  dims = PyArray_DIMS(op1);
+  if(op2 != Py_None) {
+    if(!PyArray_Check(op2) || (PyArray_TYPE(op2) != PyArray_UBYTE &&
+                               PyArray_TYPE(op2) != PyArray_BOOL) ||
+       !PyArray_ISCARRAY(op2) || PyArray_NDIM(op2) != 2 ||
+       PyArray_DIMS(op2)[0] != dims[0] || PyArray_DIMS(op2)[1] != dims[1]) {
+      PyErr_SetString(PyExc_Exception, "Unwrap2DPyramid: The mask should be a C-contiguous uint8 or bool array of the shape of the phase");
+      return NULL;
+    }
+    bmask = (BYTE *)PyArray_DATA(op2);
+  }
+  if(op4 != Py_None && !PyDict_Check(op4)) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DPyramid: stats should be a dict");
+    return NULL;
+  }
+
+  /* the context, its stats and the buffers of the pyramid belong to this
+     call alone, so several threads can run pyramids at once */
+  wrap_context(&ctx, wrap_y, wrap_x);
+  if(op4 != Py_None) ctx.stats = &stats;
+  Py_BEGIN_ALLOW_THREADS
+  phase_unwrap_2D_pyramid(&ctx, (float *)PyArray_DATA(op1),
+                          (float *)PyArray_DATA(op3), bmask,
+                          (int) dims[0], (int) dims[1], levels);
+  Py_END_ALLOW_THREADS
+
+  if(op4 != Py_None) {
+    if(stats_to_dict(op4, &stats) < 0) return NULL;
+    if((value = PyInt_FromLong(stats.No_of_dirty)) == NULL) return NULL;
+    if(PyDict_SetItemString(op4, "dirty", value) < 0) {
+      Py_DECREF(value);
+      return NULL;
+    }
+    Py_DECREF(value);
+  }
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static char doc_Unwrap2DStreamCreate[] = "Makes a stream for unwrapping a sequence of 2D arrays of the given (rows, columns) shape, each one warm-started from the one before; accepts an optional (axis 0, axis 1) tuple of wraparound flags";
+
+static void punwrap2D_destroy_stream(PyObject *capsule) {
+  unwrap_stream_destroy((UNWRAP_STREAM *)PyCapsule_GetPointer(capsule, "punwrap2D.stream"));
+}
+
+PyObject *punwrap2D_Unwrap2DStreamCreate(PyObject *self, PyObject *args) {
+  int n_pe, n_fe;
+  int wrap_y = -1, wrap_x = -1;
+  UNWRAP_CONTEXT ctx;
+  UNWRAP_STREAM *stream;
+
+  if(!PyArg_ParseTuple(args, "(ii)|(ii)", &n_pe, &n_fe, &wrap_y, &wrap_x)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2DStreamCreate: Couldn't parse the arguments");
+    return NULL;
+  }
+  if(n_pe < 1 || n_fe < 1) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DStreamCreate: The shape should be positive");
+    return NULL;
+  }
+  wrap_context(&ctx, wrap_y, wrap_x);
+  stream = unwrap_stream_create(&ctx, n_pe, n_fe);
+  if(stream == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  return PyCapsule_New(stream, "punwrap2D.stream", punwrap2D_destroy_stream);
+}
+
+static char doc_Unwrap2DStream[] = "Unwraps the next 2D float32 array of a stream into a float32 array of the same shape; accepts a uint8 or bool mask or None. Returns the No. of pixels which were re-resolved, or -1 if the array was unwrapped in full";
+
+PyObject *punwrap2D_Unwrap2DStream(PyObject *self, PyObject *args) {
+  PyObject *capsule, *op1, *op2, *op3;
+  UNWRAP_STREAM *stream;
+  UNWRAP_STATS stats;
+  BYTE *bmask = NULL;
+  long No_of_warm;
+
+  if(!PyArg_ParseTuple(args, "OOOO", &capsule, &op1, &op2, &op3)) {
+    PyErr_SetString(PyExc_Exception,"Unwrap2DStream: Couldn't parse the arguments");
+    return NULL;
+  }
+  stream = (UNWRAP_STREAM *)PyCapsule_GetPointer(capsule, "punwrap2D.stream");
+  if(stream == NULL) return NULL;
+  if(!plan_array(op1, PyArray_FLOAT, 0, stream->plan) || !plan_array(op3, PyArray_FLOAT, 1, stream->plan)) {
+    PyErr_SetString(PyExc_Exception, "Unwrap2DStream: The phase and the output should be C-contiguous float32 arrays of the shape of the stream");
+    return NULL;
+  }
+  if(op2 != Py_None) {
+    if(!plan_array(op2, PyArray_UBYTE, 0, stream->plan) && !plan_array(op2, PyArray_BOOL, 0, stream->plan)) {
+      PyErr_SetString(PyExc_Exception, "Unwrap2DStream: The mask should be a C-contiguous uint8 or bool array of the shape of the stream");
+      return NULL;
+    }
+    bmask = (BYTE *)PyArray_DATA(op2);
+  }
+  if(!capsule_acquire(capsule, "Unwrap2DStream: The stream is being used by another thread"))
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS
+  stream->plan->ctx.stats = &stats;
+  No_of_warm = stream->No_of_warm;
+  phase_unwrap_2D_stream(stream, (float *)PyArray_DATA(op1), 
+                         (float *)PyArray_DATA(op3), bmask);
+  stream->plan->ctx.stats = NULL;
+  Py_END_ALLOW_THREADS
+  capsule_release(capsule);
+
+  return PyInt_FromLong(stream->No_of_warm > No_of_warm ? stats.No_of_dirty : -1);
 }
 
 static struct PyMethodDef punwrap2D_module_methods[] = {
   {"Unwrap2D",	(PyCFunction)punwrap2D_Unwrap2D, 1, doc_Unwrap2D},
+  {"Unwrap2DStack",	(PyCFunction)punwrap2D_Unwrap2DStack, 1, doc_Unwrap2DStack},
+  {"Unwrap3D",	(PyCFunction)punwrap2D_Unwrap3D, 1, doc_Unwrap3D},
+  {"Unwrap2DTiled",	(PyCFunction)punwrap2D_Unwrap2DTiled, 1, doc_Unwrap2DTiled},
+  {"Unwrap2DPlanCreate",	(PyCFunction)punwrap2D_Unwrap2DPlanCreate, 1, doc_Unwrap2DPlanCreate},
+  {"Unwrap2DPlan",	(PyCFunction)punwrap2D_Unwrap2DPlan, 1, doc_Unwrap2DPlan},
+  {"Unwrap2DStreamCreate",	(PyCFunction)punwrap2D_Unwrap2DStreamCreate, 1, doc_Unwrap2DStreamCreate},
+  {"Unwrap2DStream",	(PyCFunction)punwrap2D_Unwrap2DStream, 1, doc_Unwrap2DStream},
+  {"Unwrap2DPyramid",	(PyCFunction)punwrap2D_Unwrap2DPyramid, 1, doc_Unwrap2DPyramid},
   {NULL, NULL, 0}
 };
 
@@ -0,0 +1,218 @@
+//Coarse-to-fine unwrapping of large images. The wrapped phase is
+//downsampled into a pyramid of levels, each half the size of the one
+//below, the coarsest level is unwrapped in full by phase_unwrap_2D_ctx,
+//and every finer level is warm-started by phase_unwrap_2D_predicted from
+//the unwrapped level above it, upsampled. Most of the wrap structure of a
+//smooth surface is already there at low resolution, so at each finer level
+//only the pixels whose predicted wrap count is inconsistent (see
+//unwrap_stream.c) are given reliabilities and edges, sorted and merged.
+//
+//Each coarse pixel is the mean phase of the unmasked pixels of its 2x2
+//block, taken as the first of them plus the mean of their wrapped
+//differences from it, and is unmasked if any of them is. The prediction
+//of a pixel is the bilinear interpolation of the unmasked coarse pixels
+//around it, which always include its own block.
+//
+//A coarse level which aliases a steep surface is wrong by whole cycles
+//over regions, but as in a warm frame each connected region of clean
+//pixels is a group of its own, and the dirty pixels around a wrong region
+//let the merge put it right. The warm starts leave out the wraparound
+//edges, which the full unwrap of a surface that is not periodic merges
+//last of all anyway. So where every pair of neighbours away from the
+//seams differs by less than pi, as on a smooth noiseless surface, and the
+//mask is connected without the seams, the result is that of unwrapping
+//the image in full up to a constant 2*pi*k, with or without wraparound;
+//on a noisy image it can differ from it by whole numbers of 2*pi in
+//places. A level with too many dirty pixels is unwrapped in full. The
+//pyramid computes its own reliabilities, so it takes no quality map and
+//fills in no reliability map, and the levels above the finest one do not
+//use the workspace of the context.
+
+#include "Munther_2D_unwrap.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static float PI = 3.141592654;
+static float TWOPI = 6.283185307;
+
+//the limits of the warm starts, as the defaults of a stream
+#define PYRAMID_MAX_CHANGE (TWOPI / 4)
+#define PYRAMID_MAX_DIRTY 0.25f
+
+//levels are added until the coarsest one is no larger than this
+#define PYRAMID_PIXELS 262144
+//or it would have a side shorter than this
+#define PYRAMID_SIDE 16
+
+static float wrap_pi(float difference)
+{
+  if (difference > PI) return difference - TWOPI;
+  if (difference < -PI) return difference + TWOPI;
+  return difference;
+}
+
+//the coarse level of n_pe x n_fe, of (n_pe + 1) / 2 x (n_fe + 1) / 2
+//pixels. input_mask may be NULL.
+static void downsample(float *WrappedImage, BYTE *input_mask, int n_pe,
+                       int n_fe, float *coarse, BYTE *coarse_mask)
+{
+  int coarse_width = (n_fe + 1) / 2;
+  int ci, cj, i, j, index, count;
+  float first, sum;
+
+  for (ci = 0; ci < (n_pe + 1) / 2; ci++)
+  {
+    for (cj = 0; cj < coarse_width; cj++)
+    {
+      count = 0;
+      first = sum = 0;
+      for (i = 2 * ci; i < 2 * ci + 2 && i < n_pe; i++)
+      {
+        for (j = 2 * cj; j < 2 * cj + 2 && j < n_fe; j++)
+        {
+          index = i * n_fe + j;
+          if (input_mask != NULL && input_mask[index] == 0) continue;
+          if (count++ == 0)
+            first = WrappedImage[index];
+          else
+            sum += wrap_pi(WrappedImage[index] - first);
+        }
+      }
+      index = ci * coarse_width + cj;
+      coarse[index] = (count > 0) ? wrap_pi(first + sum / count) : 0;
+      coarse_mask[index] = (count > 0) ? 255 : 0;
+    }
+  }
+}
+
+//the prediction of every unmasked pixel of n_pe x n_fe from the unwrapped
+//coarse level. The coarse pixel ci, cj is at 2 * ci + 0.5, 2 * cj + 0.5 of
+//the image.
+static void upsample(float *coarse, BYTE *coarse_mask, BYTE *input_mask,
+                     int n_pe, int n_fe, float *Prediction)
+{
+  int coarse_height = (n_pe + 1) / 2;
+  int coarse_width = (n_fe + 1) / 2;
+  int i, j, k, ci[2], cj[2], index;
+  float wi[2], wj[2], weight, value, sum;
+
+  for (i = 0; i < n_pe; i++)
+  {
+    ci[0] = (i + 1) / 2 - 1;
+    wi[1] = (i & 1) ? 0.25f : 0.75f;
+    wi[0] = 1 - wi[1];
+    ci[1] = ci[0] + 1;
+    if (ci[0] < 0) ci[0] = 0;
+    if (ci[1] >= coarse_height) ci[1] = coarse_height - 1;
+    for (j = 0; j < n_fe; j++)
+    {
+      index = i * n_fe + j;
+      if (input_mask != NULL && input_mask[index] == 0)
+      {
+        Prediction[index] = 0;
+        continue;
+      }
+      cj[0] = (j + 1) / 2 - 1;
+      wj[1] = (j & 1) ? 0.25f : 0.75f;
+      wj[0] = 1 - wj[1];
+      cj[1] = cj[0] + 1;
+      if (cj[0] < 0) cj[0] = 0;
+      if (cj[1] >= coarse_width) cj[1] = coarse_width - 1;
+      value = sum = 0;
+      for (k = 0; k < 4; k++)
+      {
+        if (coarse_mask[ci[k >> 1] * coarse_width + cj[k & 1]] == 0) continue;
+        weight = wi[k >> 1] * wj[k & 1];
+        value += weight * coarse[ci[k >> 1] * coarse_width + cj[k & 1]];
+        sum += weight;
+      }
+      Prediction[index] = value / sum;
+    }
+  }
+}
+
+//the No. of levels above an image of n_pe x n_fe which the pyramid
+//builds by default
+static int default_levels(int n_pe, int n_fe)
+{
+  int levels = 0;
+
+  while ((long) n_pe * n_fe > PYRAMID_PIXELS &&
+         n_pe >= 2 * PYRAMID_SIDE && n_fe >= 2 * PYRAMID_SIDE)
+  {
+    n_pe = (n_pe + 1) / 2;
+    n_fe = (n_fe + 1) / 2;
+    levels++;
+  }
+  return levels;
+}
+
+//unwrap a level of the pyramid with levels more above it. The unwrapped
+//coarse level is upsampled into UnwrappedImage, which is the prediction of
+//the warm start. If the coarse level cannot be unwrapped (or allocated)
+//the level is unwrapped in full.
+static int pyramid_level(UNWRAP_CONTEXT *ctx, float *WrappedImage,
+                         float *UnwrappedImage, BYTE *input_mask, int n_pe,
+                         int n_fe, int levels)
+{
+  size_t coarse_size = (size_t) ((n_pe + 1) / 2) * ((n_fe + 1) / 2);
+  void *workspace = ctx->workspace;
+  float *coarse, *coarse_unwrapped;
+  BYTE *coarse_mask;
+  int unwrapped = 0;
+
+  if (levels == 0)
+    return phase_unwrap_2D_ctx(ctx, WrappedImage, UnwrappedImage, input_mask,
+                               n_pe, n_fe);
+
+  coarse = (float *) malloc(coarse_size * sizeof(float));
+  coarse_unwrapped = (float *) malloc(coarse_size * sizeof(float));
+  coarse_mask = (BYTE *) malloc(coarse_size);
+  if (coarse != NULL && coarse_unwrapped != NULL && coarse_mask != NULL)
+  {
+    downsample(WrappedImage, input_mask, n_pe, n_fe, coarse, coarse_mask);
+    ctx->workspace = NULL;
+    unwrapped = pyramid_level(ctx, coarse, coarse_unwrapped, coarse_mask,
+                              (n_pe + 1) / 2, (n_fe + 1) / 2, levels - 1);
+    ctx->workspace = workspace;
+    if (unwrapped)
+      upsample(coarse_unwrapped, coarse_mask, input_mask, n_pe, n_fe,
+               UnwrappedImage);
+  }
+  free(coarse);
+  free(coarse_unwrapped);
+  free(coarse_mask);
+
+  if (!unwrapped)
+    return phase_unwrap_2D_ctx(ctx, WrappedImage, UnwrappedImage, input_mask,
+                               n_pe, n_fe);
+  return phase_unwrap_2D_predicted(ctx, WrappedImage, UnwrappedImage,
+                                   UnwrappedImage, input_mask, n_pe, n_fe,
+                                   PYRAMID_MAX_CHANGE, PYRAMID_MAX_DIRTY);
+}
+
+//unwrap an image of n_pe x n_fe coarse to fine, with levels levels above
+//it, or as many as default_levels gives if levels is negative. 0 levels is
+//phase_unwrap_2D_ctx. The stats are those of the finest level but for
+//total_seconds, which covers the whole pyramid. Returns what
+//phase_unwrap_2D_ctx returns for the finest level.
+int phase_unwrap_2D_pyramid(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                            float* UnwrappedImage, BYTE* input_mask,
+                            int n_pe, int n_fe, int levels)
+{
+  UNWRAP_CONTEXT level_ctx = *ctx;
+  double begin = 0;
+  int unwrapped;
+
+  if (ctx->stats != NULL) begin = unwrap_seconds();
+  if (levels < 0) levels = default_levels(n_pe, n_fe);
+  level_ctx.quality = NULL;
+  level_ctx.reliability_map = NULL;
+  unwrapped = pyramid_level(&level_ctx, WrappedImage, UnwrappedImage,
+                            input_mask, n_pe, n_fe, levels);
+  ctx->seed = level_ctx.seed;
+  ctx->No_of_edges = level_ctx.No_of_edges;
+  if (ctx->stats != NULL) ctx->stats->total_seconds = unwrap_seconds() - begin;
+  return unwrapped;
+}
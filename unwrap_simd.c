@@ -0,0 +1,279 @@
+//Vectorised kernels of the unwrapper, chosen at run time by the features of
+//the CPU. Every kernel does the same additions and multiplications in the
+//same order as the scalar kernel, and wrap() is done without branches by
+//subtracting or adding 2*pi under a comparison mask, so all of them give
+//the same reliabilities as calculate_reliability. The phase kernels do the
+//same for the atan2 of phase_row_scalar, so all of them give the same
+//phases.
+//
+//The SSE2, AVX2 and AVX-512 kernels are compiled with gcc target
+//attributes, so the library runs on any x86-64 CPU and only uses the
+//instructions the CPU has. On other CPUs only the scalar kernel is built.
+//AVX-512 brings fused multiply-adds, which gcc would use for the MUL and
+//ADD pairs above -O1 and which round once instead of twice, so the kernels
+//and the Makefile turn off fp-contract for this file.
+
+#include "Munther_2D_unwrap.h"
+
+#include <math.h>
+
+static float PI = 3.141592654;
+static float TWOPI = 6.283185307;
+static float HALF_PI = 1.570796327;
+static float QUARTER_PI = 0.7853981634;
+
+//the constants of the atan of phase_row_scalar, from the single precision
+//atan of Cephes: the argument is reduced to [0, tan(pi/8)], where the odd
+//polynomial is good to about 2e-7
+#define TAN_PI_8 0.4142135624f
+#define ATAN_C0 8.05374449538e-2f
+#define ATAN_C1 -1.38776856032e-1f
+#define ATAN_C2 1.99777106478e-1f
+#define ATAN_C3 -3.33329491539e-1f
+
+//the reliability of n pixels in a row, as calculate_reliability computes it
+//for a pixel which is not on a border. up, centre and down point at the
+//first of the pixels in the row above, the row itself and the row below.
+static void reliability_row_scalar(const float *up, const float *centre,
+                                   const float *down, float *reliability,
+                                   int n)
+{
+	float H, V, D1, D2;
+	int j;
+
+	for (j = 0; j < n; j++)
+	{
+		H = wrap(centre[j - 1] - centre[j]) - wrap(centre[j] - centre[j + 1]);
+		V = wrap(up[j] - centre[j]) - wrap(centre[j] - down[j]);
+		D1 = wrap(up[j - 1] - centre[j]) - wrap(centre[j] - down[j + 1]);
+		D2 = wrap(up[j + 1] - centre[j]) - wrap(centre[j] - down[j - 1]);
+		reliability[j] = H*H + V*V + D1*D1 + D2*D2;
+	}
+}
+
+//the phase of n complex values, stored as pairs of floats (real,
+//imaginary), which is atan2(imaginary, real) but with the steps of the
+//vector kernels
+static void phase_row_scalar(const float *interferogram, float *phase, int n)
+{
+	float re, im, a, num, den, t, base, z, p;
+	int j, swap;
+
+	for (j = 0; j < n; j++)
+	{
+		re = interferogram[2 * j];
+		im = interferogram[2 * j + 1];
+		swap = fabsf(im) > fabsf(re);
+		num = swap ? fabsf(re) : fabsf(im);
+		den = swap ? fabsf(im) : fabsf(re);
+		t = (den > 0) ? num / den : 0;
+		base = (t > TAN_PI_8) ? QUARTER_PI : 0;
+		t = (t > TAN_PI_8) ? (t - 1) / (t + 1) : t;
+		z = t * t;
+		p = ((ATAN_C0 * z + ATAN_C1) * z + ATAN_C2) * z + ATAN_C3;
+		a = base + (p * z * t + t);
+		a = swap ? HALF_PI - a : a;
+		a = (re < 0) ? PI - a : a;
+		phase[j] = copysignf(a, im);
+	}
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+
+//one kernel for each vector width. WRAP(x) subtracts 2*pi where x > pi
+//and adds 2*pi where x < -pi.
+#define RELIABILITY_ROW_KERNEL(name, isa, width, VEC, LOAD, STORE, SET1, \
+                               ADD, SUB, MUL, WRAP)                          \
+__attribute__((target(isa), optimize("fp-contract=off")))                 \
+static void name(const float *up, const float *centre, const float *down,    \
+                 float *reliability, int n)                                  \
+{                                                                            \
+	VEC pi = SET1(PI), minus_pi = SET1(-PI), twopi = SET1(TWOPI);            \
+	VEC c, H, V, D1, D2;                                                     \
+	int j;                                                                   \
+                                                                             \
+	for (j = 0; j + width <= n; j += width)                                  \
+	{                                                                        \
+		c = LOAD(centre + j);                                                \
+		H = SUB(WRAP(SUB(LOAD(centre + j - 1), c)),                          \
+		        WRAP(SUB(c, LOAD(centre + j + 1))));                         \
+		V = SUB(WRAP(SUB(LOAD(up + j), c)),                                  \
+		        WRAP(SUB(c, LOAD(down + j))));                               \
+		D1 = SUB(WRAP(SUB(LOAD(up + j - 1), c)),                             \
+		         WRAP(SUB(c, LOAD(down + j + 1))));                          \
+		D2 = SUB(WRAP(SUB(LOAD(up + j + 1), c)),                             \
+		         WRAP(SUB(c, LOAD(down + j - 1))));                          \
+		STORE(reliability + j, ADD(ADD(ADD(MUL(H, H), MUL(V, V)),            \
+		                               MUL(D1, D1)), MUL(D2, D2)));          \
+	}                                                                        \
+	reliability_row_scalar(up + j, centre + j, down + j, reliability + j,    \
+	                       n - j);                                           \
+}
+
+#define WRAP_SSE(x) _mm_add_ps(                                              \
+	_mm_sub_ps((x), _mm_and_ps(_mm_cmpgt_ps((x), pi), twopi)),               \
+	_mm_and_ps(_mm_cmplt_ps((x), minus_pi), twopi))
+#define WRAP_AVX(x) _mm256_add_ps(                                           \
+	_mm256_sub_ps((x), _mm256_and_ps(_mm256_cmp_ps((x), pi, _CMP_GT_OQ),     \
+	                                 twopi)),                                \
+	_mm256_and_ps(_mm256_cmp_ps((x), minus_pi, _CMP_LT_OQ), twopi))
+#define WRAP_AVX512(x) _mm512_mask_add_ps(                                   \
+	_mm512_mask_sub_ps((x), _mm512_cmp_ps_mask((x), pi, _CMP_GT_OQ),         \
+	                   (x), twopi),                                          \
+	_mm512_cmp_ps_mask((x), minus_pi, _CMP_LT_OQ), (x), twopi)
+
+RELIABILITY_ROW_KERNEL(reliability_row_sse2, "sse2", 4, __m128,
+                       _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps,
+                       _mm_add_ps, _mm_sub_ps, _mm_mul_ps, WRAP_SSE)
+RELIABILITY_ROW_KERNEL(reliability_row_avx2, "avx2", 8, __m256,
+                       _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps,
+                       _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, WRAP_AVX)
+RELIABILITY_ROW_KERNEL(reliability_row_avx512, "avx512f", 16, __m512,
+                       _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps,
+                       _mm512_add_ps, _mm512_sub_ps, _mm512_mul_ps,
+                       WRAP_AVX512)
+
+//one phase kernel for each vector width. DEINTERLEAVE loads width complex
+//values into their real and imaginary parts, SELECT(m, a, b) is a where
+//the comparison m holds and b elsewhere, and COPYSIGN(a, x) gives a, which
+//is not negative, the sign bit of x.
+#define PHASE_ROW_KERNEL(name, isa, width, VEC, STORE, SET1, ADD, SUB, MUL, \
+                         DIV, ABS, GT, LT, SELECT, COPYSIGN, DEINTERLEAVE)   \
+__attribute__((target(isa), optimize("fp-contract=off")))                 \
+static void name(const float *interferogram, float *phase, int n)            \
+{                                                                            \
+	VEC zero = SET1(0), one = SET1(1), tan_pi_8 = SET1(TAN_PI_8);            \
+	VEC c0 = SET1(ATAN_C0), c1 = SET1(ATAN_C1), c2 = SET1(ATAN_C2);          \
+	VEC c3 = SET1(ATAN_C3), pi = SET1(PI), half_pi = SET1(HALF_PI);          \
+	VEC quarter_pi = SET1(QUARTER_PI);                                       \
+	VEC re, im, a, num, den, t, base, z, p;                                  \
+	int j;                                                                   \
+                                                                             \
+	for (j = 0; j + width <= n; j += width)                                  \
+	{                                                                        \
+		DEINTERLEAVE(interferogram + 2 * j, re, im);                         \
+		num = SELECT(GT(ABS(im), ABS(re)), ABS(re), ABS(im));                \
+		den = SELECT(GT(ABS(im), ABS(re)), ABS(im), ABS(re));                \
+		t = SELECT(GT(den, zero), DIV(num, den), zero);                      \
+		base = SELECT(GT(t, tan_pi_8), quarter_pi, zero);                    \
+		t = SELECT(GT(t, tan_pi_8), DIV(SUB(t, one), ADD(t, one)), t);       \
+		z = MUL(t, t);                                                       \
+		p = ADD(MUL(ADD(MUL(ADD(MUL(c0, z), c1), z), c2), z), c3);           \
+		a = ADD(base, ADD(MUL(MUL(p, z), t), t));                            \
+		a = SELECT(GT(ABS(im), ABS(re)), SUB(half_pi, a), a);                \
+		a = SELECT(LT(re, zero), SUB(pi, a), a);                             \
+		STORE(phase + j, COPYSIGN(a, im));                                   \
+	}                                                                        \
+	phase_row_scalar(interferogram + 2 * j, phase + j, n - j);               \
+}
+
+#define SIGN_SSE _mm_castsi128_ps(_mm_set1_epi32((int) 0x80000000))
+#define ABS_SSE(x) _mm_andnot_ps(SIGN_SSE, (x))
+#define SELECT_SSE(m, a, b) _mm_or_ps(_mm_and_ps((m), (a)),                  \
+                                      _mm_andnot_ps((m), (b)))
+#define COPYSIGN_SSE(a, x) _mm_or_ps((a), _mm_and_ps(SIGN_SSE, (x)))
+#define DEINTERLEAVE_SSE(pointer, re, im) do {                               \
+	__m128 low = _mm_loadu_ps(pointer), high = _mm_loadu_ps((pointer) + 4);  \
+	re = _mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0));                 \
+	im = _mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1));                 \
+	} while (0)
+
+#define SIGN_AVX _mm256_castsi256_ps(_mm256_set1_epi32((int) 0x80000000))
+#define ABS_AVX(x) _mm256_andnot_ps(SIGN_AVX, (x))
+#define GT_AVX(a, b) _mm256_cmp_ps((a), (b), _CMP_GT_OQ)
+#define LT_AVX(a, b) _mm256_cmp_ps((a), (b), _CMP_LT_OQ)
+#define SELECT_AVX(m, a, b) _mm256_blendv_ps((b), (a), (m))
+#define COPYSIGN_AVX(a, x) _mm256_or_ps((a), _mm256_and_ps(SIGN_AVX, (x)))
+//the in-lane shuffles leave the middle quarters of the row swapped
+#define DEINTERLEAVE_AVX(pointer, re, im) do {                               \
+	__m256 low = _mm256_loadu_ps(pointer);                                   \
+	__m256 high = _mm256_loadu_ps((pointer) + 8);                            \
+	re = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(            \
+	     _mm256_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0))), 0xD8));     \
+	im = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(            \
+	     _mm256_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1))), 0xD8));     \
+	} while (0)
+
+//AVX-512F has no floating point logic, so the sign bits are handled as
+//integers
+#define SIGN_AVX512 _mm512_set1_epi32((int) 0x80000000)
+#define ABS_AVX512(x) _mm512_abs_ps(x)
+#define GT_AVX512(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_GT_OQ)
+#define LT_AVX512(a, b) _mm512_cmp_ps_mask((a), (b), _CMP_LT_OQ)
+#define SELECT_AVX512(m, a, b) _mm512_mask_blend_ps((m), (b), (a))
+#define COPYSIGN_AVX512(a, x) _mm512_castsi512_ps(_mm512_or_si512(           \
+	_mm512_castps_si512(a), _mm512_and_si512(SIGN_AVX512,                    \
+	                                         _mm512_castps_si512(x))))
+#define DEINTERLEAVE_AVX512(pointer, re, im) do {                            \
+	__m512 low = _mm512_loadu_ps(pointer);                                   \
+	__m512 high = _mm512_loadu_ps((pointer) + 16);                           \
+	re = _mm512_permutex2var_ps(low, _mm512_set_epi32(30, 28, 26, 24, 22,    \
+	     20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0), high);                      \
+	im = _mm512_permutex2var_ps(low, _mm512_set_epi32(31, 29, 27, 25, 23,    \
+	     21, 19, 17, 15, 13, 11, 9, 7, 5, 3, 1), high);                      \
+	} while (0)
+
+PHASE_ROW_KERNEL(phase_row_sse2, "sse2", 4, __m128, _mm_storeu_ps,
+                 _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_div_ps,
+                 ABS_SSE, _mm_cmpgt_ps, _mm_cmplt_ps, SELECT_SSE,
+                 COPYSIGN_SSE, DEINTERLEAVE_SSE)
+PHASE_ROW_KERNEL(phase_row_avx2, "avx2", 8, __m256, _mm256_storeu_ps,
+                 _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps,
+                 _mm256_div_ps, ABS_AVX, GT_AVX, LT_AVX, SELECT_AVX,
+                 COPYSIGN_AVX, DEINTERLEAVE_AVX)
+PHASE_ROW_KERNEL(phase_row_avx512, "avx512f", 16, __m512, _mm512_storeu_ps,
+                 _mm512_set1_ps, _mm512_add_ps, _mm512_sub_ps, _mm512_mul_ps,
+                 _mm512_div_ps, ABS_AVX512, GT_AVX512, LT_AVX512,
+                 SELECT_AVX512, COPYSIGN_AVX512, DEINTERLEAVE_AVX512)
+#endif
+
+//the widest kernel this CPU can run
+SIMD_LEVEL best_simd_level(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+	return SIMD_SCALAR;
+}
+
+//the kernel for level, or the widest one below it which this CPU can run
+RELIABILITY_ROW reliability_row_kernel(SIMD_LEVEL level)
+{
+	SIMD_LEVEL best = best_simd_level();
+
+	if (level > best) level = best;
+#ifdef HAVE_X86_KERNELS
+	switch (level)
+	{
+		case SIMD_AVX512: return reliability_row_avx512;
+		case SIMD_AVX2:   return reliability_row_avx2;
+		case SIMD_SSE2:   return reliability_row_sse2;
+		default:          break;
+	}
+#endif
+	return reliability_row_scalar;
+}
+
+//the phase kernel for level, or the widest one below it which this CPU can
+//run
+PHASE_ROW phase_row_kernel(SIMD_LEVEL level)
+{
+	SIMD_LEVEL best = best_simd_level();
+
+	if (level > best) level = best;
+#ifdef HAVE_X86_KERNELS
+	switch (level)
+	{
+		case SIMD_AVX512: return phase_row_avx512;
+		case SIMD_AVX2:   return phase_row_avx2;
+		case SIMD_SSE2:   return phase_row_sse2;
+		default:          break;
+	}
+#endif
+	return phase_row_scalar;
+}
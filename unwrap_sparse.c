@@ -0,0 +1,320 @@
+//The sparse layout of the unwrapper, for images of which a large part is
+//masked, such as circular apertures. Only the unmasked pixels get a PIXELM,
+//and they are found through a CSR index of the mask: row_start[i] is the
+//index of the first unmasked pixel of row i and column[k] is the column of
+//unmasked pixel k, so row i has the pixels row_start[i] <= k <
+//row_start[i + 1]. Edges are only built between unmasked neighbours, found
+//by walking the columns of two rows side by side.
+//
+//The reliabilities, the edges and their order are those of
+//phase_unwrap_2D_ctx, so the sorts and merges of the PIXELM layout are used
+//as they are and the unwrapped image is the same. Memory and time follow
+//the No. of unmasked pixels, but for reading the mask, writing the
+//unwrapped image and stepping the random generator once for every pixel,
+//as initialisePIXELs does, which are a few operations per pixel.
+
+#include "Munther_2D_unwrap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static float TWOPI = 6.283185307;
+
+struct SPARSE
+{
+  int *row_start;               //n_pe + 1 indices into column and pixel
+  int *column;
+  int No_of_pixels;             //No. of unmasked pixels
+  PIXELM *pixel;                //one for each unmasked pixel
+  EDGE *edge;
+  int No_of_edges;
+  int image_width;
+  int image_height;
+};
+
+typedef struct SPARSE SPARSE;
+
+//build the CSR index of the unmasked pixels. Returns 0 if there is not
+//enough memory.
+static int sparse_index(SPARSE *sparse, BYTE *input_mask)
+{
+  int image_width = sparse->image_width;
+  int image_height = sparse->image_height;
+  int i, j, k = 0;
+  BYTE *IMP = input_mask;
+
+  sparse->row_start = (int *) malloc((image_height + 1) * sizeof(int));
+  if (sparse->row_start == NULL) return 0;
+  for (i = 0; i < image_height; i++)
+  {
+    sparse->row_start[i] = k;
+    for (j = 0; j < image_width; j++)
+      if (*IMP++ != 0) k++;
+  }
+  sparse->row_start[image_height] = k;
+  sparse->No_of_pixels = k;
+  sparse->column = (int *) malloc((k > 0 ? k : 1) * sizeof(int));
+  if (sparse->column == NULL) return 0;
+
+  IMP = input_mask;
+  k = 0;
+  for (i = 0; i < image_height; i++)
+    for (j = 0; j < image_width; j++)
+      if (*IMP++ != 0) sparse->column[k++] = j;
+  return 1;
+}
+
+//the rule of stencil_pixel of unwrap_compact.c on the byte mask: a pixel
+//has the reliability of calculate_reliability when extend_mask would set
+//it. row and column are the indices of the neighbours.
+static int sparse_stencil(UNWRAP_CONTEXT *ctx, SPARSE *sparse,
+                          BYTE *input_mask, int i, int j, int *row,
+                          int *column)
+{
+  int image_width = sparse->image_width;
+  int image_height = sparse->image_height;
+  int a, b;
+
+  if ((i == 0 || i == image_height - 1) && !ctx->y_connectivity) return 0;
+  if ((j == 0 || j == image_width - 1) && !ctx->x_connectivity) return 0;
+  if ((i == 0 || i == image_height - 1) && (j == 0 || j == image_width - 1))
+    return 0;
+  row[0] = (i == 0) ? image_height - 1 : i - 1;
+  row[1] = i;
+  row[2] = (i == image_height - 1) ? 0 : i + 1;
+  column[0] = (j == 0) ? image_width - 1 : j - 1;
+  column[1] = j;
+  column[2] = (j == image_width - 1) ? 0 : j + 1;
+  for (a = 0; a < 3; a++)
+    for (b = 0; b < 3; b++)
+      if (input_mask[row[a] * image_width + column[b]] == 0)
+        return 0;
+  return 1;
+}
+
+//initialisePIXELs and calculate_reliability for the unmasked pixels. The
+//pixels away from the borders are done by the vector kernel on each run of
+//neighbouring pixels which have the full stencil, the others one by one.
+static void sparse_pixels(UNWRAP_CONTEXT *ctx, SPARSE *sparse,
+                          float *WrappedImage, BYTE *input_mask,
+                          float *row_reliability)
+{
+  int image_width = sparse->image_width;
+  int image_height = sparse->image_height;
+  int *column = sparse->column;
+  RELIABILITY_ROW reliability_row = reliability_row_kernel(ctx->simd_level);
+  PIXELM *pixel_pointer;
+  float *centre_row;
+  float centre, H, V, D1, D2;
+  int i, j, k, l, end, run, rows[3], columns[3];
+  unsigned int random;
+
+  for (i = 0; i < image_height; i++)
+  {
+    k = sparse->row_start[i];
+    end = sparse->row_start[i + 1];
+    //one random reliability for every pixel of the row, masked or not
+    for (j = 0; j < image_width; j++)
+    {
+      random = (unsigned int) rand_r(&ctx->seed);
+      if (k == end || column[k] != j) continue;
+      pixel_pointer = sparse->pixel + k;
+      pixel_pointer->increment = 0;
+      pixel_pointer->number_of_pixels_in_group = 1;
+      pixel_pointer->value = WrappedImage[i * image_width + j];
+      pixel_pointer->reliability = (float) (9999999.0 + random);
+      pixel_pointer->input_mask = input_mask[i * image_width + j];
+      pixel_pointer->extended_mask = 0;
+      pixel_pointer->head = pixel_pointer;
+      pixel_pointer->last = pixel_pointer;
+      pixel_pointer->next = NULL;
+      pixel_pointer->new_group = 0;
+      pixel_pointer->group = -1;
+      k++;
+    }
+  }
+
+  for (i = 0; i < image_height; i++)
+  {
+    end = sparse->row_start[i + 1];
+    for (k = sparse->row_start[i]; k < end; k++)
+    {
+      j = column[k];
+      if (!sparse_stencil(ctx, sparse, input_mask, i, j, rows, columns))
+        continue;
+      if (i > 0 && i < image_height - 1 && j > 0 && j < image_width - 1)
+      {
+        //the run of neighbours in the row which all have the stencil
+        for (run = 1; k + run < end && column[k + run] == j + run &&
+             j + run < image_width - 1 &&
+             sparse_stencil(ctx, sparse, input_mask, i, j + run, rows,
+                            columns); run++)
+          ;
+        centre_row = WrappedImage + i * image_width + j;
+        reliability_row(centre_row - image_width, centre_row,
+                        centre_row + image_width, row_reliability, run);
+        for (l = 0; l < run; l++)
+        {
+          sparse->pixel[k + l].extended_mask = 255;
+          sparse->pixel[k + l].reliability = row_reliability[l];
+        }
+        k += run - 1;
+        continue;
+      }
+
+#define VALUE(a, b) WrappedImage[rows[a] * image_width + columns[b]]
+      centre = VALUE(1, 1);
+      H = wrap(VALUE(1, 0) - centre) - wrap(centre - VALUE(1, 2));
+      V = wrap(VALUE(0, 1) - centre) - wrap(centre - VALUE(2, 1));
+      D1 = wrap(VALUE(0, 0) - centre) - wrap(centre - VALUE(2, 2));
+      D2 = wrap(VALUE(0, 2) - centre) - wrap(centre - VALUE(2, 0));
+#undef VALUE
+      sparse->pixel[k].extended_mask = 255;
+      sparse->pixel[k].reliability = H*H + V*V + D1*D1 + D2*D2;
+    }
+  }
+}
+
+static void sparse_add_edge(SPARSE *sparse, int index1, int index2)
+{
+  EDGE *edge = sparse->edge + sparse->No_of_edges;
+  PIXELM *pixel1 = sparse->pixel + index1;
+  PIXELM *pixel2 = sparse->pixel + index2;
+
+  edge->pointer_1 = pixel1;
+  edge->pointer_2 = pixel2;
+  edge->reliab = pixel1->reliability + pixel2->reliability;
+  edge->increment = find_wrap(pixel1->value, pixel2->value);
+  sparse->No_of_edges++;
+}
+
+//the edges from the pixels of row upper to those below them in row lower
+static void sparse_vertical_edges(SPARSE *sparse, int upper, int lower)
+{
+  int k = sparse->row_start[upper];
+  int k_end = sparse->row_start[upper + 1];
+  int l = sparse->row_start[lower];
+  int l_end = sparse->row_start[lower + 1];
+
+  while (k < k_end && l < l_end)
+  {
+    if (sparse->column[k] < sparse->column[l]) k++;
+    else if (sparse->column[k] > sparse->column[l]) l++;
+    else sparse_add_edge(sparse, k++, l++);
+  }
+}
+
+//the edges are built in the same order as horizentalEDGEs and verticalEDGEs
+static void sparse_edges(UNWRAP_CONTEXT *ctx, SPARSE *sparse)
+{
+  int image_width = sparse->image_width;
+  int image_height = sparse->image_height;
+  int *row_start = sparse->row_start;
+  int *column = sparse->column;
+  int i, k;
+
+  sparse->No_of_edges = 0;
+  for (i = 0; i < image_height; i++)
+    for (k = row_start[i]; k < row_start[i + 1] - 1; k++)
+      if (column[k + 1] == column[k] + 1)
+        sparse_add_edge(sparse, k, k + 1);
+  if (ctx->x_connectivity == 1)
+    for (i = 0; i < image_height; i++)
+      if (row_start[i + 1] > row_start[i] && column[row_start[i]] == 0 &&
+          column[row_start[i + 1] - 1] == image_width - 1)
+        sparse_add_edge(sparse, row_start[i + 1] - 1, row_start[i]);
+  for (i = 0; i < image_height - 1; i++)
+    sparse_vertical_edges(sparse, i, i + 1);
+  if (ctx->y_connectivity == 1)
+    sparse_vertical_edges(sparse, image_height - 1, 0);
+  ctx->No_of_edges = sparse->No_of_edges;
+}
+
+//unwrapImage, maskImage and returnImage for the sparse layout
+static void sparse_return(SPARSE *sparse, float *UnwrappedImage)
+{
+  int image_width = sparse->image_width;
+  int image_height = sparse->image_height;
+  float min = 99999999.;
+  float *row;
+  int i, j, k;
+
+  for (k = 0; k < sparse->No_of_pixels; k++)
+  {
+    sparse->pixel[k].value += TWOPI * (float) (sparse->pixel[k].increment);
+    if (sparse->pixel[k].value < min) min = sparse->pixel[k].value;
+  }
+  for (i = 0; i < image_height; i++)
+  {
+    row = UnwrappedImage + i * image_width;
+    j = 0;
+    for (k = sparse->row_start[i]; k < sparse->row_start[i + 1]; k++)
+    {
+      for (; j < sparse->column[k]; j++) row[j] = min;
+      row[j++] = sparse->pixel[k].value;
+    }
+    for (; j < image_width; j++) row[j] = min;
+  }
+}
+
+//No. of bytes phase_unwrap_2D_sparse allocates for an n_pe x n_fe image
+//with No_of_pixels unmasked pixels
+size_t sparse_workspace_size(UNWRAP_CONTEXT *ctx, int n_pe, int n_fe,
+                             int No_of_pixels)
+{
+  size_t size = (n_pe + 1) * sizeof(int) + n_fe * sizeof(float) +
+                (size_t) No_of_pixels * (sizeof(int) + sizeof(PIXELM)) +
+                2 * (size_t) No_of_pixels * sizeof(EDGE);
+
+  if (ctx->sort_method != QUICKER_SORT)
+    size += 2 * (size_t) No_of_pixels * sizeof(EDGE);
+  if (ctx->merge_method == BORUVKA)
+    size += 6 * (size_t) No_of_pixels * sizeof(int);
+  return size;
+}
+
+//phase_unwrap_2D_ctx in the sparse layout. Called by phase_unwrap_2D_ctx
+//once the mask is known to be sane. The buffers of a plan are not used, as
+//their size follows the mask.
+int phase_unwrap_2D_sparse(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                           float* UnwrappedImage, BYTE* input_mask,
+                           int n_pe, int n_fe)
+{
+  SPARSE sparse;
+  float *row_reliability;
+  double start = 0;
+  int done = 0;
+
+  if (ctx->stats != NULL) start = unwrap_seconds();
+  memset(&sparse, 0, sizeof(sparse));
+  sparse.image_width = n_fe;
+  sparse.image_height = n_pe;
+  row_reliability = (float *) malloc(n_fe * sizeof(float));
+  if (row_reliability == NULL || !sparse_index(&sparse, input_mask))
+    goto cleanup;
+  sparse.pixel = (PIXELM *) malloc((sparse.No_of_pixels + 1) * sizeof(PIXELM));
+  sparse.edge = (EDGE *) malloc((2 * (size_t) sparse.No_of_pixels + 1) *
+                                sizeof(EDGE));
+  if (sparse.pixel == NULL || sparse.edge == NULL) goto cleanup;
+  STATS_LAP(ctx, mask_seconds, start);
+
+  sparse_pixels(ctx, &sparse, WrappedImage, input_mask, row_reliability);
+  STATS_LAP(ctx, reliability_seconds, start);
+  sparse_edges(ctx, &sparse);
+  STATS_LAP(ctx, edges_seconds, start);
+  sortEDGEs(ctx, sparse.edge, sparse.No_of_edges);
+  STATS_LAP(ctx, sort_seconds, start);
+  mergePIXELs(ctx, sparse.pixel, sparse.edge, sparse.No_of_pixels, 1);
+  STATS_LAP(ctx, merge_seconds, start);
+  sparse_return(&sparse, UnwrappedImage);
+  STATS_LAP(ctx, return_seconds, start);
+  done = 1;
+
+cleanup:
+  free(sparse.edge);
+  free(sparse.pixel);
+  free(sparse.column);
+  free(sparse.row_start);
+  free(row_reliability);
+  return done;
+}
@@ -0,0 +1,536 @@
+//Streams of images, such as the frames of dynamic interferometry, in which
+//each image differs little from the one before. The first frame, and any
+//frame whose mask differs from the one before, is unwrapped in full by a
+//plan. Every other frame is warm-started from the frame before:
+//
+// - each unmasked pixel takes the No. of 2*pi which brings it nearest to
+//   the pixel of the last unwrapped frame,
+// - a pixel is dirty if that leaves it more than max_change away from the
+//   last frame, or if an edge to it is unwrapped differently from how
+//   gatherPIXELs would unwrap that edge on its own, and
+// - each connected region of clean pixels keeps its wrap counts as one
+//   group, and only the dirty pixels are merged, along the edges which
+//   have a dirty pixel, in order of reliability, joining the regions.
+//
+//So the reliabilities, edges, sort and merge only cover the dirty pixels
+//and their neighbours, and a frame with no dirty pixels is just a rounding
+//per pixel. When more than max_dirty of the unmasked pixels are dirty the
+//frame is unwrapped in full instead.
+//
+//An edge between clean pixels is unwrapped as gatherPIXELs would unwrap
+//it, so a region of clean pixels is right relative to itself even where
+//the last frame was wrong by whole cycles, and the regions are placed
+//relative to each other by the merge. The merge takes the edges inside
+//the regions first, whatever their reliabilities, so a noisy warm frame
+//can still differ from unwrapping the frame on its own by whole numbers
+//of 2*pi in places, besides the constant 2*pi*k that keeps it continuous
+//with the frames before. Every group is put nearest to the last frame at
+//its root.
+//
+//The wraparound edges are left out of a warm frame (see right_kind), so
+//the seams of a context that wraps around are only unwrapped as the last
+//frame had them, and parts of the mask that are joined only across a seam
+//are each put nearest to the last frame on their own.
+//
+//phase_unwrap_2D_predicted warm-starts an image in the same way from any
+//prediction of its unwrapped phase, such as the upsampled phase of the
+//coarser level of a pyramid (see unwrap_pyramid.c), with no plan or stream
+//of its own.
+
+#include "Munther_2D_unwrap.h"
+#include "unwrap_compact.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static float PI = 3.141592654;
+static float TWOPI = 6.283185307;
+
+//the kinds of edge of the compact layout, as in unwrap_compact.c
+#define RIGHT_NEIGHBOUR   0
+#define RIGHT_WRAPAROUND  1
+#define LOWER_NEIGHBOUR   2
+#define LOWER_WRAPAROUND  3
+
+//the bits of stream->dirty
+#define DIRTY             1
+#define HAS_RELIABILITY   2
+
+//the buffers of the warm frames. Returns 0 if any is missing.
+static int warm_buffers(UNWRAP_STREAM *stream, size_t image_size)
+{
+  stream->wrap_count = (int *) malloc(image_size * sizeof(int));
+  stream->dirty = (BYTE *) malloc(image_size);
+  stream->mask_bits = (unsigned long long *)
+    malloc(((image_size + 63) / 64) * sizeof(unsigned long long));
+  stream->parent = (int *) malloc(image_size * sizeof(int));
+  stream->increment = (int *) malloc(image_size * sizeof(int));
+  stream->reliability = (float *) malloc(image_size * sizeof(float));
+  stream->edge = (COMPACT_EDGE *) malloc(2 * image_size * sizeof(COMPACT_EDGE));
+  return stream->wrap_count != NULL && stream->dirty != NULL &&
+         stream->mask_bits != NULL && stream->parent != NULL &&
+         stream->increment != NULL && stream->reliability != NULL &&
+         stream->edge != NULL;
+}
+
+static void free_warm_buffers(UNWRAP_STREAM *stream)
+{
+  free(stream->wrap_count);
+  free(stream->dirty);
+  free(stream->mask_bits);
+  free(stream->parent);
+  free(stream->increment);
+  free(stream->reliability);
+  free(stream->edge);
+}
+
+UNWRAP_STREAM *unwrap_stream_create(UNWRAP_CONTEXT *ctx, int n_pe, int n_fe)
+{
+  UNWRAP_STREAM *stream = (UNWRAP_STREAM *) calloc(1, sizeof(UNWRAP_STREAM));
+  size_t image_size = (size_t) n_pe * n_fe;
+
+  if (stream == NULL) return NULL;
+  stream->n_pe = n_pe;
+  stream->n_fe = n_fe;
+  stream->max_change = (float) (TWOPI / 4);
+  stream->max_dirty = 0.25f;
+  stream->plan = unwrap_plan_create(ctx, n_pe, n_fe);
+  //the warm frames compute their own reliabilities, so no frame takes a
+  //quality map or fills in a reliability map
+  if (stream->plan != NULL)
+  {
+    stream->plan->ctx.quality = NULL;
+    stream->plan->ctx.reliability_map = NULL;
+  }
+  stream->last_unwrapped = (float *) malloc(image_size * sizeof(float));
+  stream->last_mask = (BYTE *) malloc(image_size);
+  if (!warm_buffers(stream, image_size) || stream->plan == NULL ||
+      stream->last_unwrapped == NULL || stream->last_mask == NULL)
+  {
+    unwrap_stream_destroy(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+//forget the last frame, so that the next one is unwrapped in full
+void unwrap_stream_reset(UNWRAP_STREAM *stream)
+{
+  stream->has_last = 0;
+}
+
+void unwrap_stream_destroy(UNWRAP_STREAM *stream)
+{
+  if (stream == NULL) return;
+  unwrap_plan_destroy(stream->plan);
+  free(stream->last_unwrapped);
+  free(stream->last_mask);
+  free_warm_buffers(stream);
+  free(stream);
+}
+
+static void stream_compact(UNWRAP_STREAM *stream, COMPACT *compact,
+                           float *WrappedImage)
+{
+  int n_pe = stream->n_pe;
+  int n_fe = stream->n_fe;
+
+  compact->value = WrappedImage;
+  compact->reliability = stream->reliability;
+  compact->parent = stream->parent;
+  compact->increment = stream->increment;
+  compact->mask = stream->mask_bits;
+  compact->edge = stream->edge;
+  compact->No_of_edges = 0;
+  compact->image_size = n_pe * n_fe;
+  compact->image_width = n_fe;
+  compact->image_height = n_pe;
+  compact->kind_bits = 2;
+  compact->neighbour[RIGHT_NEIGHBOUR] = 1;
+  compact->neighbour[LOWER_NEIGHBOUR] = n_fe;
+  compact->neighbour[RIGHT_WRAPAROUND] = 1 - n_fe;
+  compact->neighbour[LOWER_WRAPAROUND] = -n_fe * (n_pe - 1);
+  compact->stats = stream->plan->ctx.stats;
+}
+
+//the kind of the edge to the right of (or below) pixel i, j, or -1 if
+//there is none. A warm frame leaves out the wraparound edges: unless the
+//image is periodic they join pixels many cycles apart, so gatherPIXELs
+//would unwrap all of them differently from the wrap counts and every
+//border pixel would be dirty, to be merged across the seam.
+static int right_kind(COMPACT *compact, int j)
+{
+  return (j < compact->image_width - 1) ? RIGHT_NEIGHBOUR : -1;
+}
+
+static int lower_kind(COMPACT *compact, int i)
+{
+  return (i < compact->image_height - 1) ? LOWER_NEIGHBOUR : -1;
+}
+
+//whether gatherPIXELs would unwrap the edge from index to second
+//differently from the wrap counts, find_wrap being inlined
+static ALWAYS_INLINE int edge_changed(float *value, int *wrap_count,
+                                      int index, int second)
+{
+  float difference = value[index] - value[second];
+  int edge_increment = (difference < -PI) - (difference > PI);
+
+  return wrap_count[second] - wrap_count[index] != -edge_increment;
+}
+
+//the wrap count of every unmasked pixel from the last frame, and the
+//pixels which are too far from the last frame or which have an edge that
+//gatherPIXELs would unwrap differently. Returns the No. of dirty pixels.
+static int find_dirty(UNWRAP_STREAM *stream, COMPACT *compact,
+                      BYTE *input_mask)
+{
+  float *value = compact->value;
+  float *last = stream->last_unwrapped;
+  int *wrap_count = stream->wrap_count;
+  BYTE *dirty = stream->dirty;
+  int i, j, index, second, kind, No_of_dirty = 0;
+
+  for (index = 0; index < compact->image_size; index++)
+  {
+    dirty[index] = 0;
+    if (input_mask[index] == 0) continue;
+    wrap_count[index] = (int) floorf((last[index] - value[index]) * 
+                                     (1 / TWOPI) + 0.5f);
+    if (fabsf(value[index] + TWOPI * wrap_count[index] - last[index]) >
+        stream->max_change)
+      dirty[index] = DIRTY;
+  }
+
+  for (i = 0; i < compact->image_height; i++)
+  {
+    for (j = 0; j < compact->image_width; j++)
+    {
+      index = i * compact->image_width + j;
+      if (input_mask[index] == 0) continue;
+      kind = right_kind(compact, j);
+      if (kind >= 0)
+      {
+        second = index + compact->neighbour[kind];
+        if (input_mask[second] != 0 &&
+            edge_changed(value, wrap_count, index, second))
+          dirty[index] = dirty[second] = DIRTY;
+      }
+      kind = lower_kind(compact, i);
+      if (kind >= 0)
+      {
+        second = index + compact->neighbour[kind];
+        if (input_mask[second] != 0 &&
+            edge_changed(value, wrap_count, index, second))
+          dirty[index] = dirty[second] = DIRTY;
+      }
+    }
+  }
+
+  for (index = 0; index < compact->image_size; index++)
+    No_of_dirty += dirty[index];
+  return No_of_dirty;
+}
+
+static void need_reliability(UNWRAP_CONTEXT *ctx, COMPACT *compact,
+                             BYTE *dirty, int i, int j)
+{
+  int index = i * compact->image_width + j;
+
+  if (dirty[index] & HAS_RELIABILITY) return;
+  compact->reliability[index] = compact_pixel_reliability(ctx, compact, i, j);
+  dirty[index] |= HAS_RELIABILITY;
+}
+
+//the reliabilities of the dirty pixels and of their neighbours, which are
+//all the pixels of the edges that are merged
+static void dirty_reliability(UNWRAP_STREAM *stream, COMPACT *compact)
+{
+  UNWRAP_CONTEXT *ctx = &stream->plan->ctx;
+  int image_width = compact->image_width;
+  int image_height = compact->image_height;
+  BYTE *dirty = stream->dirty;
+  int i, j;
+
+  for (i = 0; i < image_height; i++)
+  {
+    for (j = 0; j < image_width; j++)
+    {
+      if (!(dirty[i * image_width + j] & DIRTY)) continue;
+      need_reliability(ctx, compact, dirty, i, j);
+      if (j > 0 || ctx->x_connectivity == 1)
+        need_reliability(ctx, compact, dirty, i,
+                         (j > 0) ? j - 1 : image_width - 1);
+      if (j < image_width - 1 || ctx->x_connectivity == 1)
+        need_reliability(ctx, compact, dirty, i,
+                         (j < image_width - 1) ? j + 1 : 0);
+      if (i > 0 || ctx->y_connectivity == 1)
+        need_reliability(ctx, compact, dirty,
+                         (i > 0) ? i - 1 : image_height - 1, j);
+      if (i < image_height - 1 || ctx->y_connectivity == 1)
+        need_reliability(ctx, compact, dirty,
+                         (i < image_height - 1) ? i + 1 : 0, j);
+    }
+  }
+}
+
+//the edges with a dirty pixel, in the order of compact_edges but for the
+//wraparound edges, which are among the others
+static void dirty_edges(UNWRAP_STREAM *stream, COMPACT *compact)
+{
+  UNWRAP_CONTEXT *ctx = &stream->plan->ctx;
+  BYTE *dirty = stream->dirty;
+  int i, j, index, kind;
+
+  compact->No_of_edges = 0;
+  for (i = 0; i < compact->image_height; i++)
+  {
+    for (j = 0; j < compact->image_width; j++)
+    {
+      index = i * compact->image_width + j;
+      kind = right_kind(compact, j);
+      if (kind >= 0 &&
+          ((dirty[index] | dirty[index + compact->neighbour[kind]]) & DIRTY))
+        compact_add_edge(compact, index, kind);
+      kind = lower_kind(compact, i);
+      if (kind >= 0 &&
+          ((dirty[index] | dirty[index + compact->neighbour[kind]]) & DIRTY))
+        compact_add_edge(compact, index, kind);
+    }
+  }
+  ctx->No_of_edges = compact->No_of_edges;
+}
+
+//put the groups of two clean pixels together, the smaller under the
+//larger as gather_compact does. An edge between clean pixels is unwrapped
+//as its wrap counts say, so the increments are the differences of those.
+static void join_clean(COMPACT *compact, int *wrap_count, int index1,
+                       int index2)
+{
+  int *parent = compact->parent;
+  int root1 = compact_root(compact, index1);
+  int root2;
+
+  if (parent[index2] == -1)
+  {
+    parent[root1]--;
+    parent[index2] = root1;
+    compact->increment[index2] = wrap_count[index2] - wrap_count[root1];
+    return;
+  }
+  root2 = compact_root(compact, index2);
+  if (root1 == root2) return;
+  if (-parent[root1] < -parent[root2])
+  {
+    root1 = root2;
+    root2 = compact_root(compact, index1);
+  }
+  parent[root1] += parent[root2];
+  parent[root2] = root1;
+  compact->increment[root2] = wrap_count[root2] - wrap_count[root1];
+}
+
+//every connected region of clean pixels starts as one group, with the
+//increments of their wrap counts relative to its root, and the dirty
+//pixels on their own. Returns the No. of groups of clean pixels.
+static int start_groups(UNWRAP_STREAM *stream, COMPACT *compact,
+                        BYTE *input_mask)
+{
+  int *wrap_count = stream->wrap_count;
+  BYTE *dirty = stream->dirty;
+  int i, j, index, second, kind, No_of_groups = 0;
+
+  for (index = 0; index < compact->image_size; index++)
+  {
+    compact->parent[index] = -1;
+    compact->increment[index] = 0;
+  }
+  for (i = 0; i < compact->image_height; i++)
+  {
+    for (j = 0; j < compact->image_width; j++)
+    {
+      index = i * compact->image_width + j;
+      if (input_mask[index] == 0 || (dirty[index] & DIRTY)) continue;
+      kind = right_kind(compact, j);
+      if (kind >= 0)
+      {
+        second = index + compact->neighbour[kind];
+        if (input_mask[second] != 0 && !(dirty[second] & DIRTY))
+          join_clean(compact, wrap_count, index, second);
+      }
+      kind = lower_kind(compact, i);
+      if (kind >= 0)
+      {
+        second = index + compact->neighbour[kind];
+        if (input_mask[second] != 0 && !(dirty[second] & DIRTY))
+          join_clean(compact, wrap_count, index, second);
+      }
+    }
+  }
+  for (index = 0; index < compact->image_size; index++)
+    if (input_mask[index] != 0 && !(dirty[index] & DIRTY) &&
+        compact->parent[index] < 0)
+      No_of_groups++;
+  return No_of_groups;
+}
+
+//compact_return for a warm frame. Every group is put back on the wrap
+//count of its root, so the largest region of clean pixels in it keeps its
+//wrap counts. The increment of a root is always 0.
+static void stream_return(UNWRAP_STREAM *stream, COMPACT *compact,
+                          BYTE *input_mask, float *UnwrappedImage)
+{
+  int *wrap_count = stream->wrap_count;
+  int image_size = compact->image_size;
+  float min = 99999999.;
+  int index, root;
+
+  for (index = 0; index < image_size; index++)
+  {
+    if (input_mask[index] == 0) continue;
+    root = compact_root(compact, index);
+    UnwrappedImage[index] = compact->value[index] +
+      TWOPI * (float) (wrap_count[root] + compact->increment[index]);
+    if (UnwrappedImage[index] < min) min = UnwrappedImage[index];
+  }
+  for (index = 0; index < image_size; index++)
+    if (input_mask[index] == 0)
+      UnwrappedImage[index] = min;
+}
+
+//unwrap a frame from the wrap counts of the last frame. Returns 0 if too
+//many pixels are dirty, or the frame is too large for compact_fits, having
+//written nothing.
+static int warm_frame(UNWRAP_STREAM *stream, float *WrappedImage,
+                      float *UnwrappedImage, BYTE *input_mask)
+{
+  UNWRAP_CONTEXT *ctx = &stream->plan->ctx;
+  UNWRAP_STATS *stats = ctx->stats;
+  COMPACT compact;
+  double begin = 0, start = 0;
+  long No_of_unmasked = 0;
+  int index, No_of_dirty, No_of_clean_groups;
+
+  if (!compact_fits((size_t) stream->n_pe * stream->n_fe, 2)) return 0;
+
+  if (stats != NULL)
+  {
+    memset(stats, 0, sizeof(UNWRAP_STATS));
+    begin = start = unwrap_seconds();
+  }
+  stream_compact(stream, &compact, WrappedImage);
+  for (index = 0; index < compact.image_size; index++)
+    if (input_mask[index] != 0) No_of_unmasked++;
+  STATS_LAP(ctx, mask_seconds, start);
+
+  No_of_dirty = find_dirty(stream, &compact, input_mask);
+  if (No_of_dirty > stream->max_dirty * No_of_unmasked) return 0;
+  ctx->seed = stream->plan->seed;
+  dirty_reliability(stream, &compact);
+  STATS_LAP(ctx, reliability_seconds, start);
+  dirty_edges(stream, &compact);
+  STATS_LAP(ctx, edges_seconds, start);
+  compact_sort(compact.edge, compact.No_of_edges, compact.kind_bits);
+  STATS_LAP(ctx, sort_seconds, start);
+  No_of_clean_groups = start_groups(stream, &compact, input_mask);
+  compact_gather(&compact);
+  STATS_LAP(ctx, merge_seconds, start);
+  stream_return(stream, &compact, input_mask, UnwrappedImage);
+  STATS_LAP(ctx, return_seconds, start);
+
+  if (stats != NULL)
+  {
+    stats->No_of_edges = compact.No_of_edges;
+    stats->No_of_groups = No_of_dirty + No_of_clean_groups -
+                          stats->No_of_merges;
+    stats->No_of_dirty = No_of_dirty;
+    stats->total_seconds = unwrap_seconds() - begin;
+  }
+  return 1;
+}
+
+//unwrap the next frame of a stream of images of the size of the stream.
+//Returns what phase_unwrap_2D_plan returns.
+int phase_unwrap_2D_stream(UNWRAP_STREAM *stream, float* WrappedImage,
+                           float* UnwrappedImage, BYTE* input_mask)
+{
+  size_t image_size = (size_t) stream->n_pe * stream->n_fe;
+  COMPACT compact;
+  int unwrapped;
+
+  if (input_mask == NULL) input_mask = stream->plan->workspace.full_mask;
+  if (stream->has_last && memcmp(input_mask, stream->last_mask, image_size) == 0 &&
+      warm_frame(stream, WrappedImage, UnwrappedImage, input_mask))
+  {
+    stream->No_of_warm++;
+    memcpy(stream->last_unwrapped, UnwrappedImage, image_size * sizeof(float));
+    return 1;
+  }
+
+  unwrapped = phase_unwrap_2D_plan(stream->plan, WrappedImage, UnwrappedImage,
+                                   input_mask);
+  stream->No_of_cold++;
+  stream->has_last = unwrapped;
+  if (unwrapped)
+  {
+    memcpy(stream->last_unwrapped, UnwrappedImage, image_size * sizeof(float));
+    memcpy(stream->last_mask, input_mask, image_size);
+    stream_compact(stream, &compact, WrappedImage);
+    compact_pack_mask(&compact, input_mask);
+  }
+  return unwrapped;
+}
+
+//unwrap an image of n_pe x n_fe from a prediction of its unwrapped phase,
+//as a warm frame is unwrapped from the frame before, with the max_change
+//and max_dirty of a stream. Prediction may be UnwrappedImage, as it is
+//read before anything is written. The image is unwrapped in full by
+//phase_unwrap_2D_ctx instead when too many pixels are dirty or there is
+//not enough memory for the warm start. Returns what phase_unwrap_2D_ctx
+//returns.
+int phase_unwrap_2D_predicted(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                              float* Prediction, float* UnwrappedImage,
+                              BYTE* input_mask, int n_pe, int n_fe,
+                              float max_change, float max_dirty)
+{
+  size_t image_size = (size_t) n_pe * n_fe;
+  UNWRAP_PLAN plan;
+  UNWRAP_STREAM stream;
+  COMPACT compact;
+  BYTE *mask = input_mask;
+  int warm = 0;
+
+  memset(&stream, 0, sizeof(UNWRAP_STREAM));
+  //the warm frame only needs the context and the seed of a plan
+  plan.ctx = *ctx;
+  plan.ctx.quality = NULL;
+  plan.ctx.reliability_map = NULL;
+  plan.seed = ctx->seed;
+  stream.plan = &plan;
+  stream.max_change = max_change;
+  stream.max_dirty = max_dirty;
+  stream.last_unwrapped = Prediction;
+  stream.n_pe = n_pe;
+  stream.n_fe = n_fe;
+  if (mask == NULL)
+  {
+    mask = (BYTE *) malloc(image_size);
+    if (mask != NULL) memset(mask, 255, image_size);
+  }
+  if (mask != NULL && warm_buffers(&stream, image_size) &&
+      isSaneMask(mask, n_pe, n_fe))
+  {
+    stream_compact(&stream, &compact, WrappedImage);
+    compact_pack_mask(&compact, mask);
+    warm = warm_frame(&stream, WrappedImage, UnwrappedImage, mask);
+  }
+  free_warm_buffers(&stream);
+  if (mask != input_mask) free(mask);
+  if (!warm)
+    return phase_unwrap_2D_ctx(ctx, WrappedImage, UnwrappedImage, input_mask,
+                               n_pe, n_fe);
+  ctx->seed = plan.ctx.seed;
+  ctx->No_of_edges = plan.ctx.No_of_edges;
+  return 1;
+}
@@ -0,0 +1,82 @@
+//A minimal worker pool for the unwrapper. run_parallel starts n_threads 
+//workers which take task indices from a shared counter until all of them 
+//are done, then joins the workers. The calling thread works as one of the 
+//workers, so with n_threads == 1 no thread is created at all.
+
+#include "unwrap_threads.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct WORKQUEUE
+{
+  UNWRAP_TASK task;
+  void *arg;
+  int n_tasks;
+  int next_task;                //next task index to hand out
+  pthread_mutex_t lock;
+};
+
+typedef struct WORKQUEUE WORKQUEUE;
+
+//number of workers used when the caller asks for 0 (or fewer) threads
+int unwrap_default_threads(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (int) n : 1;
+}
+
+static void *worker(void *queue_pointer)
+{
+  WORKQUEUE *queue = (WORKQUEUE *) queue_pointer;
+  int index;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&queue->lock);
+    index = queue->next_task++;
+    pthread_mutex_unlock(&queue->lock);
+    if (index >= queue->n_tasks) break;
+    queue->task(queue->arg, index);
+  }
+  return NULL;
+}
+
+void run_parallel(int n_threads, int n_tasks, UNWRAP_TASK task, void *arg)
+{
+  WORKQUEUE queue;
+  pthread_t *threads;
+  int i, n_started;
+
+  if (n_threads <= 0) n_threads = unwrap_default_threads();
+  if (n_threads > n_tasks) n_threads = n_tasks;
+  if (n_threads <= 1)
+  {
+    for (i = 0; i < n_tasks; i++) task(arg, i);
+    return;
+  }
+
+  queue.task = task;
+  queue.arg = arg;
+  queue.n_tasks = n_tasks;
+  queue.next_task = 0;
+  pthread_mutex_init(&queue.lock, NULL);
+
+  //if a thread cannot be started the remaining workers pick up its share
+  threads = (pthread_t *) malloc((n_threads - 1) * sizeof(pthread_t));
+  n_started = 0;
+  if (threads != NULL)
+  {
+    for (i = 0; i < n_threads - 1; i++)
+    {
+      if (pthread_create(&threads[n_started], NULL, worker, &queue) == 0)
+        n_started++;
+    }
+  }
+  worker(&queue);
+  for (i = 0; i < n_started; i++) pthread_join(threads[i], NULL);
+
+  free(threads);
+  pthread_mutex_destroy(&queue.lock);
+}
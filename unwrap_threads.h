@@ -0,0 +1,11 @@
+#ifndef __UNWRAP_THREADS
+#define __UNWRAP_THREADS
+
+//a task is called once for every index 0 <= index < n_tasks, from whichever
+//worker thread is free first
+typedef void (*UNWRAP_TASK)(void *arg, int index);
+
+int  unwrap_default_threads(void);
+void run_parallel(int n_threads, int n_tasks, UNWRAP_TASK task, void *arg);
+
+#endif
@@ -0,0 +1,682 @@
+//Tiled unwrapping of images which are too large to unwrap at once. The
+//image is cut into tiles of tile_size x tile_size pixels and
+//
+// - every tile is unwrapped on its own, in parallel, by the compact layout.
+//   A tile overlaps its neighbours by one pixel on each side, so its own
+//   pixels get the same reliabilities as in the whole image, but no edge
+//   leaves the tile,
+// - the root of the group of every pixel within its tile is kept in a
+//   label map, and the groups which reach the border of their tile become
+//   the nodes of a second merge,
+// - the edges between neighbouring tiles (and across the borders which
+//   are connected) are sorted by reliability and merge the nodes by the
+//   rules of compact_gather, which gives the No. of 2*pi to add to each
+//   group, and
+// - each tile adds the offsets of its groups, and the masked pixels are
+//   set to the minimum of the image as maskImage does.
+//
+//This is the same reliability-ordered unwrapping as phase_unwrap_2D, but
+//the edges between tiles are merged after all the edges within tiles, so
+//the result can differ from phase_unwrap_2D near the borders of the tiles.
+//
+//The wrapped and unwrapped images and the label map can be memory-mapped
+//files, as phase_unwrap_2D_tiled_files uses them. Besides the files the
+//memory used is one tile workspace for each thread, see
+//unwrap_tiled_workspace_size, plus about 24 bytes for every edge between
+//tiles, so roughly (n_pe + n_fe) * n_pe * n_fe / tile_size^2 * 24 bytes.
+
+#define _XOPEN_SOURCE 700
+
+#include "unwrap_tiled.h"
+#include "unwrap_compact.h"
+#include "unwrap_threads.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static float TWOPI = 6.283185307;
+
+//where a tile is in the image. The halo is the overlap with the
+//neighbouring tiles, one row or column on each side which has a neighbour.
+struct TILE
+{
+  long row;                     //first row of the tile in the image
+  long column;                  //first column of the tile in the image
+  int height;
+  int width;
+  int top;                      //1 if there is a halo row above the tile
+  int left;                     //1 if there is a halo column left of it
+  int halo_height;              //size of the tile with its halo
+  int halo_width;
+};
+
+typedef struct TILE TILE;
+
+//an edge between two tiles. increment is the No. of 2*pi which the group
+//of node2 needs relative to the group of node1.
+struct SEAM_EDGE
+{
+  int node1;
+  int node2;
+  int increment;
+};
+
+typedef struct SEAM_EDGE SEAM_EDGE;
+
+struct TILED
+{
+  UNWRAP_CONTEXT *ctx;
+  float *WrappedImage;
+  float *UnwrappedImage;
+  BYTE *input_mask;             //NULL if no pixel is masked
+  int *label;                   //root of the group of each pixel in its tile
+  long n_pe;
+  long n_fe;
+  int tile_size;
+  int tiles_across;
+  int tiles_down;
+  int **root;                   //sorted roots on the border of each tile
+  int *No_of_roots;
+  int *first_node;              //node of the first root of each tile
+  COMPACT nodes;                //the union-find of the nodes
+  float *min;                   //minimum unwrapped value of each tile
+  float image_min;
+  int failed;
+};
+
+typedef struct TILED TILED;
+
+static void tile_geometry(TILED *tiled, int index, TILE *tile)
+{
+  int bottom, right;
+
+  tile->row = (long) (index / tiled->tiles_across) * tiled->tile_size;
+  tile->column = (long) (index % tiled->tiles_across) * tiled->tile_size;
+  tile->height = (int) ((tiled->n_pe - tile->row < tiled->tile_size) ?
+                        tiled->n_pe - tile->row : tiled->tile_size);
+  tile->width = (int) ((tiled->n_fe - tile->column < tiled->tile_size) ?
+                       tiled->n_fe - tile->column : tiled->tile_size);
+  tile->top = (tile->row > 0 || tiled->ctx->y_connectivity);
+  bottom = (tile->row + tile->height < tiled->n_pe ||
+            tiled->ctx->y_connectivity);
+  tile->left = (tile->column > 0 || tiled->ctx->x_connectivity);
+  right = (tile->column + tile->width < tiled->n_fe ||
+           tiled->ctx->x_connectivity);
+  tile->halo_height = tile->height + tile->top + bottom;
+  tile->halo_width = tile->width + tile->left + right;
+}
+
+static int tile_of(TILED *tiled, long i, long j)
+{
+  return (int) (i / tiled->tile_size) * tiled->tiles_across +
+         (int) (j / tiled->tile_size);
+}
+
+static int is_unmasked(TILED *tiled, long index)
+{
+  return tiled->input_mask == NULL || tiled->input_mask[index] != 0;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+  int x = *(const int *) a;
+  int y = *(const int *) b;
+  return (x > y) - (x < y);
+}
+
+//copy a tile and its halo out of the image, unwrap it, and put the tile
+//and the labels of its pixels back
+static void unwrap_tile(void *arg, int index)
+{
+  TILED *tiled = (TILED *) arg;
+  UNWRAP_CONTEXT ctx = *tiled->ctx;
+  TILE tile;
+  float *wrapped = NULL, *unwrapped = NULL;
+  BYTE *mask = NULL;
+  int *label = NULL, *root = NULL;
+  int a, b, local, size, No_of_roots, k;
+  long i, j, image_index;
+
+  tile_geometry(tiled, index, &tile);
+  size = tile.halo_height * tile.halo_width;
+  wrapped = (float *) malloc(size * sizeof(float));
+  unwrapped = (float *) malloc(size * sizeof(float));
+  mask = (BYTE *) malloc(size);
+  label = (int *) malloc(size * sizeof(int));
+  root = (int *) malloc(2 * (tile.height + tile.width) * sizeof(int));
+  if (!wrapped || !unwrapped || !mask || !label || !root)
+  {
+    tiled->failed = 1;
+    free(root);
+    goto cleanup;
+  }
+
+  for (a = 0; a < tile.halo_height; a++)
+  {
+    i = tile.row - tile.top + a;
+    if (i < 0) i += tiled->n_pe;
+    if (i >= tiled->n_pe) i -= tiled->n_pe;
+    for (b = 0; b < tile.halo_width; b++)
+    {
+      j = tile.column - tile.left + b;
+      if (j < 0) j += tiled->n_fe;
+      if (j >= tiled->n_fe) j -= tiled->n_fe;
+      image_index = i * tiled->n_fe + j;
+      wrapped[a * tile.halo_width + b] = tiled->WrappedImage[image_index];
+      mask[a * tile.halo_width + b] = is_unmasked(tiled, image_index) ? 255 : 0;
+    }
+  }
+
+  //the halo stands in for the wrap around, so the tile itself is not
+  //connected
+  ctx.x_connectivity = 0;
+  ctx.y_connectivity = 0;
+  ctx.seed += index;
+  ctx.workspace = NULL;
+  ctx.stats = NULL;
+  if (!phase_unwrap_2D_compact_labels(&ctx, wrapped, unwrapped, mask,
+                                      tile.halo_height, tile.halo_width,
+                                      label))
+  {
+    tiled->failed = 1;
+    free(root);
+    goto cleanup;
+  }
+
+  No_of_roots = 0;
+  for (a = 0; a < tile.height; a++)
+  {
+    for (b = 0; b < tile.width; b++)
+    {
+      local = (a + tile.top) * tile.halo_width + b + tile.left;
+      image_index = (tile.row + a) * tiled->n_fe + tile.column + b;
+      tiled->UnwrappedImage[image_index] = unwrapped[local];
+      tiled->label[image_index] = label[local];
+      if ((a == 0 || a == tile.height - 1 || b == 0 || b == tile.width - 1) &&
+          mask[local] == 255)
+        root[No_of_roots++] = label[local];
+    }
+  }
+
+  //keep each root on the border once
+  qsort(root, No_of_roots, sizeof(int), compare_int);
+  k = 0;
+  for (a = 0; a < No_of_roots; a++)
+    if (k == 0 || root[a] != root[k - 1]) root[k++] = root[a];
+  tiled->root[index] = root;
+  tiled->No_of_roots[index] = k;
+
+cleanup:
+  free(label);
+  free(mask);
+  free(unwrapped);
+  free(wrapped);
+}
+
+//the reliability calculate_reliability gives pixel (i, j) of the whole
+//image, or a random one as for the pixels stencil_pixel rejects
+static float pixel_reliability(TILED *tiled, long i, long j)
+{
+  UNWRAP_CONTEXT *ctx = tiled->ctx;
+  long n_pe = tiled->n_pe;
+  long n_fe = tiled->n_fe;
+  long row[3], column[3];
+  int a, b;
+  float centre, H, V, D1, D2;
+
+  if (((i == 0 || i == n_pe - 1) && !ctx->y_connectivity) ||
+      ((j == 0 || j == n_fe - 1) && !ctx->x_connectivity) ||
+      ((i == 0 || i == n_pe - 1) && (j == 0 || j == n_fe - 1)))
+    return (float) (9999999.0 + rand_r(&ctx->seed));
+  row[0] = (i == 0) ? n_pe - 1 : i - 1;
+  row[1] = i;
+  row[2] = (i == n_pe - 1) ? 0 : i + 1;
+  column[0] = (j == 0) ? n_fe - 1 : j - 1;
+  column[1] = j;
+  column[2] = (j == n_fe - 1) ? 0 : j + 1;
+  for (a = 0; a < 3; a++)
+    for (b = 0; b < 3; b++)
+      if (!is_unmasked(tiled, row[a] * n_fe + column[b]))
+        return (float) (9999999.0 + rand_r(&ctx->seed));
+
+#define VALUE(a, b) tiled->WrappedImage[row[a] * n_fe + column[b]]
+  centre = VALUE(1, 1);
+  H = wrap(VALUE(1, 0) - centre) - wrap(centre - VALUE(1, 2));
+  V = wrap(VALUE(0, 1) - centre) - wrap(centre - VALUE(2, 1));
+  D1 = wrap(VALUE(0, 0) - centre) - wrap(centre - VALUE(2, 2));
+  D2 = wrap(VALUE(0, 2) - centre) - wrap(centre - VALUE(2, 0));
+#undef VALUE
+  return H*H + V*V + D1*D1 + D2*D2;
+}
+
+//the node of the group with the given root in a tile
+static int node_of(TILED *tiled, int tile, int label)
+{
+  int *root = (int *) bsearch(&label, tiled->root[tile],
+                              tiled->No_of_roots[tile], sizeof(int),
+                              compare_int);
+  return tiled->first_node[tile] + (int) (root - tiled->root[tile]);
+}
+
+//No. of 2*pi the unwrapper added to a pixel
+static int wrap_count(float wrapped, float unwrapped)
+{
+  return (int) floorf((unwrapped - wrapped) / TWOPI + 0.5f);
+}
+
+//add the edge from pixel (i1, j1) to pixel (i2, j2) of another tile, if
+//neither of them is masked
+static void add_seam_edge(TILED *tiled, COMPACT_EDGE *edge, SEAM_EDGE *seam,
+                          int *No_of_seams, long i1, long j1, long i2,
+                          long j2)
+{
+  long index1 = i1 * tiled->n_fe + j1;
+  long index2 = i2 * tiled->n_fe + j2;
+  float *value = tiled->WrappedImage;
+  float *unwrapped = tiled->UnwrappedImage;
+  int k = *No_of_seams;
+
+  if (!is_unmasked(tiled, index1) || !is_unmasked(tiled, index2)) return;
+  seam[k].node1 = node_of(tiled, tile_of(tiled, i1, j1), tiled->label[index1]);
+  seam[k].node2 = node_of(tiled, tile_of(tiled, i2, j2), tiled->label[index2]);
+  seam[k].increment = wrap_count(value[index1], unwrapped[index1]) -
+                      find_wrap(value[index1], value[index2]) -
+                      wrap_count(value[index2], unwrapped[index2]);
+  edge[k].reliab = pixel_reliability(tiled, i1, j1) +
+                   pixel_reliability(tiled, i2, j2);
+  edge[k].pixel = (unsigned int) k;
+  (*No_of_seams)++;
+}
+
+//build the edges between the tiles in the order of compact_edges, sort
+//them, and merge the groups on the borders of the tiles
+static int merge_tiles(TILED *tiled, int No_of_nodes)
+{
+  long n_pe = tiled->n_pe;
+  long n_fe = tiled->n_fe;
+  int tile_size = tiled->tile_size;
+  int x_connectivity = tiled->ctx->x_connectivity;
+  int y_connectivity = tiled->ctx->y_connectivity;
+  long max_seams = (tiled->tiles_across - 1 + x_connectivity) * n_pe +
+                   (tiled->tiles_down - 1 + y_connectivity) * n_fe;
+  COMPACT_EDGE *edge = (COMPACT_EDGE *) malloc((max_seams + 1) * sizeof(COMPACT_EDGE));
+  SEAM_EDGE *seam = (SEAM_EDGE *) malloc((max_seams + 1) * sizeof(SEAM_EDGE));
+  int *parent = tiled->nodes.parent;
+  int *increment = tiled->nodes.increment;
+  int No_of_seams = 0;
+  int k, root1, root2;
+  long i, j;
+  SEAM_EDGE *pointer_seam;
+
+  if (edge == NULL || seam == NULL)
+  {
+    free(seam);
+    free(edge);
+    return 0;
+  }
+
+  for (i = 0; i < n_pe; i++)
+  {
+    for (j = tile_size; j < n_fe; j += tile_size)
+      add_seam_edge(tiled, edge, seam, &No_of_seams, i, j - 1, i, j);
+    if (x_connectivity)
+      add_seam_edge(tiled, edge, seam, &No_of_seams, i, n_fe - 1, i, 0);
+  }
+  for (i = tile_size; i < n_pe; i += tile_size)
+    for (j = 0; j < n_fe; j++)
+      add_seam_edge(tiled, edge, seam, &No_of_seams, i - 1, j, i, j);
+  if (y_connectivity)
+    for (j = 0; j < n_fe; j++)
+      add_seam_edge(tiled, edge, seam, &No_of_seams, n_pe - 1, j, 0, j);
+
+  //the code of a seam edge is its place in the order they are built
+  compact_sort(edge, No_of_seams, 0);
+
+  for (k = 0; k < No_of_nodes; k++)
+  {
+    parent[k] = -1;
+    increment[k] = 0;
+  }
+  for (k = 0; k < No_of_seams; k++)
+  {
+    pointer_seam = seam + edge[k].pixel;
+    root1 = compact_root(&tiled->nodes, pointer_seam->node1);
+    root2 = compact_root(&tiled->nodes, pointer_seam->node2);
+    if (root1 == root2) continue;
+
+    //after compact_root the increment of a node is relative to its root,
+    //and a root has none
+    if (-parent[root1] >= -parent[root2])
+    {
+      parent[root1] += parent[root2];
+      parent[root2] = root1;
+      increment[root2] = increment[pointer_seam->node1] +
+                         pointer_seam->increment -
+                         increment[pointer_seam->node2];
+    }
+    else
+    {
+      parent[root2] += parent[root1];
+      parent[root1] = root2;
+      increment[root1] = increment[pointer_seam->node2] -
+                         pointer_seam->increment -
+                         increment[pointer_seam->node1];
+    }
+  }
+  for (k = 0; k < No_of_nodes; k++)
+    compact_root(&tiled->nodes, k);
+
+  free(seam);
+  free(edge);
+  return 1;
+}
+
+//add the offsets of the groups of a tile to its pixels
+static void offset_tile(void *arg, int index)
+{
+  TILED *tiled = (TILED *) arg;
+  TILE tile;
+  int *offset;
+  int a, b, k;
+  long image_index;
+  float value, min = 99999999.;
+
+  tile_geometry(tiled, index, &tile);
+  offset = (int *) calloc(tile.halo_height * tile.halo_width, sizeof(int));
+  if (offset == NULL)
+  {
+    tiled->failed = 1;
+    return;
+  }
+  for (k = 0; k < tiled->No_of_roots[index]; k++)
+    offset[tiled->root[index][k]] =
+      tiled->nodes.increment[tiled->first_node[index] + k];
+
+  for (a = 0; a < tile.height; a++)
+  {
+    for (b = 0; b < tile.width; b++)
+    {
+      image_index = (tile.row + a) * tiled->n_fe + tile.column + b;
+      if (!is_unmasked(tiled, image_index)) continue;
+      value = tiled->WrappedImage[image_index];
+      value += TWOPI * (float) (wrap_count(value, tiled->UnwrappedImage[image_index]) +
+                                offset[tiled->label[image_index]]);
+      tiled->UnwrappedImage[image_index] = value;
+      if (value < min) min = value;
+    }
+  }
+  tiled->min[index] = min;
+  free(offset);
+}
+
+//maskImage for one tile
+static void mask_tile(void *arg, int index)
+{
+  TILED *tiled = (TILED *) arg;
+  TILE tile;
+  int a, b;
+  long image_index;
+
+  tile_geometry(tiled, index, &tile);
+  for (a = 0; a < tile.height; a++)
+  {
+    for (b = 0; b < tile.width; b++)
+    {
+      image_index = (tile.row + a) * tiled->n_fe + tile.column + b;
+      if (!is_unmasked(tiled, image_index))
+        tiled->UnwrappedImage[image_index] = tiled->image_min;
+    }
+  }
+}
+
+//a scratch file of the given size mapped into memory, made next to path
+//(or in the temporary directory if path is NULL) and deleted at once, so
+//it goes away with the mapping
+static void *map_scratch(const char *path, size_t size)
+{
+  char *name;
+  FILE *file = NULL;
+  int fd;
+  void *map;
+
+  if (path == NULL)
+  {
+    file = tmpfile();
+    if (file == NULL) return NULL;
+    fd = fileno(file);
+  }
+  else
+  {
+    name = (char *) malloc(strlen(path) + 8);
+    if (name == NULL) return NULL;
+    sprintf(name, "%s.XXXXXX", path);
+    fd = mkstemp(name);
+    if (fd >= 0) unlink(name);
+    free(name);
+    if (fd < 0) return NULL;
+  }
+  map = MAP_FAILED;
+  if (ftruncate(fd, size) == 0)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (file != NULL) fclose(file);
+  else close(fd);
+  return (map == MAP_FAILED) ? NULL : map;
+}
+
+//the unwrapper for images larger than memory. label_map holds an int for
+//each pixel while unwrapping; if it is NULL a scratch file is mapped for
+//it. The wrapped and the unwrapped images must not be the same.
+//n_threads in the context is the No. of tiles unwrapped at once. Returns
+//1, or 0 if the memory ran out, in which case the unwrapped image is a
+//copy of the wrapped one.
+int phase_unwrap_2D_tiled(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                          float* UnwrappedImage, BYTE* input_mask,
+                          int* label_map, long n_pe, long n_fe,
+                          int tile_size)
+{
+  TILED tiled;
+  size_t image_size = (size_t) n_pe * n_fe;
+  int *own_label = NULL;
+  int n_tiles, No_of_nodes, k;
+
+  if (WrappedImage == UnwrappedImage || tile_size < 1) return 0;
+  if (label_map == NULL)
+  {
+    own_label = (int *) map_scratch(NULL, image_size * sizeof(int));
+    if (own_label == NULL)
+    {
+      memcpy(UnwrappedImage, WrappedImage, image_size * sizeof(float));
+      return 0;
+    }
+  }
+
+  tiled.ctx = ctx;
+  tiled.WrappedImage = WrappedImage;
+  tiled.UnwrappedImage = UnwrappedImage;
+  tiled.input_mask = input_mask;
+  tiled.label = own_label ? own_label : label_map;
+  tiled.n_pe = n_pe;
+  tiled.n_fe = n_fe;
+  tiled.tile_size = tile_size;
+  tiled.tiles_across = (int) ((n_fe + tile_size - 1) / tile_size);
+  tiled.tiles_down = (int) ((n_pe + tile_size - 1) / tile_size);
+  tiled.failed = 0;
+  n_tiles = tiled.tiles_across * tiled.tiles_down;
+  tiled.root = (int **) calloc(n_tiles, sizeof(int *));
+  tiled.No_of_roots = (int *) calloc(n_tiles, sizeof(int));
+  tiled.first_node = (int *) malloc(n_tiles * sizeof(int));
+  tiled.min = (float *) malloc(n_tiles * sizeof(float));
+  tiled.nodes.parent = NULL;
+  tiled.nodes.increment = NULL;
+  if (!tiled.root || !tiled.No_of_roots || !tiled.first_node || !tiled.min)
+    tiled.failed = 1;
+
+  if (!tiled.failed)
+    run_parallel(ctx->n_threads, n_tiles, unwrap_tile, &tiled);
+
+  if (!tiled.failed)
+  {
+    No_of_nodes = 0;
+    for (k = 0; k < n_tiles; k++)
+    {
+      tiled.first_node[k] = No_of_nodes;
+      No_of_nodes += tiled.No_of_roots[k];
+    }
+    tiled.nodes.parent = (int *) malloc((No_of_nodes + 1) * sizeof(int));
+    tiled.nodes.increment = (int *) malloc((No_of_nodes + 1) * sizeof(int));
+    if (!tiled.nodes.parent || !tiled.nodes.increment ||
+        !merge_tiles(&tiled, No_of_nodes))
+      tiled.failed = 1;
+  }
+
+  if (!tiled.failed)
+    run_parallel(ctx->n_threads, n_tiles, offset_tile, &tiled);
+
+  if (!tiled.failed && input_mask != NULL)
+  {
+    tiled.image_min = 99999999.;
+    for (k = 0; k < n_tiles; k++)
+      if (tiled.min[k] < tiled.image_min) tiled.image_min = tiled.min[k];
+    run_parallel(ctx->n_threads, n_tiles, mask_tile, &tiled);
+  }
+
+  if (tiled.failed)
+    memcpy(UnwrappedImage, WrappedImage, image_size * sizeof(float));
+
+  free(tiled.nodes.increment);
+  free(tiled.nodes.parent);
+  if (tiled.root != NULL)
+    for (k = 0; k < n_tiles; k++) free(tiled.root[k]);
+  free(tiled.min);
+  free(tiled.first_node);
+  free(tiled.No_of_roots);
+  free(tiled.root);
+  if (own_label != NULL) munmap(own_label, image_size * sizeof(int));
+  return !tiled.failed;
+}
+
+//map size bytes of a file for reading
+static void *map_file(const char *path, size_t size)
+{
+  struct stat status;
+  void *map = MAP_FAILED;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &status) == 0 && (size_t) status.st_size >= size)
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return (map == MAP_FAILED) ? NULL : map;
+}
+
+//map a new file of size bytes next to path, which is renamed to path once
+//it is written, so that path is left as it was if the unwrap fails. The
+//name of the new file is put in *name, to be freed by the caller.
+static void *map_output(const char *path, size_t size, char **name)
+{
+  void *map = MAP_FAILED;
+  int fd;
+
+  *name = (char *) malloc(strlen(path) + 8);
+  if (*name == NULL) return NULL;
+  sprintf(*name, "%s.XXXXXX", path);
+  fd = mkstemp(*name);
+  if (fd < 0)
+  {
+    free(*name);
+    *name = NULL;
+    return NULL;
+  }
+  if (fchmod(fd, 0644) == 0 && ftruncate(fd, size) == 0)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    unlink(*name);
+    free(*name);
+    *name = NULL;
+    return NULL;
+  }
+  return map;
+}
+
+//whether two paths, either of which may be NULL, name the same existing
+//file
+static int same_file(const char *path1, const char *path2)
+{
+  struct stat status1, status2;
+
+  return path1 != NULL && path2 != NULL &&
+         stat(path1, &status1) == 0 && stat(path2, &status2) == 0 &&
+         status1.st_dev == status2.st_dev && status1.st_ino == status2.st_ino;
+}
+
+//phase_unwrap_2D_tiled on raw files: wrapped_file holds n_pe x n_fe
+//native floats, mask_file (which may be NULL) one byte per pixel, nonzero
+//at good points as for phase_unwrap_2D, and unwrapped_file is created or
+//replaced, once the unwrap has succeeded, by a file written next to it.
+//unwrapped_file may not be wrapped_file or mask_file. The label map is a
+//scratch file next to unwrapped_file. Returns 1, or 0, leaving
+//unwrapped_file as it was, if the files are the same, a file cannot be
+//mapped or the memory ran out.
+int phase_unwrap_2D_tiled_files(UNWRAP_CONTEXT *ctx, const char *wrapped_file,
+                                const char *unwrapped_file,
+                                const char *mask_file, long n_pe, long n_fe,
+                                int tile_size)
+{
+  size_t image_size = (size_t) n_pe * n_fe;
+  float *wrapped = NULL, *unwrapped = NULL;
+  BYTE *mask = NULL;
+  int *label = NULL;
+  char *unwrapped_name = NULL;
+  int result = 0;
+
+  if (same_file(wrapped_file, unwrapped_file) ||
+      same_file(mask_file, unwrapped_file))
+    return 0;
+  wrapped = (float *) map_file(wrapped_file, image_size * sizeof(float));
+  if (mask_file) mask = (BYTE *) map_file(mask_file, image_size);
+  if (wrapped && (mask || !mask_file))
+    unwrapped = (float *) map_output(unwrapped_file,
+                                     image_size * sizeof(float),
+                                     &unwrapped_name);
+  if (unwrapped)
+    label = (int *) map_scratch(unwrapped_file, image_size * sizeof(int));
+
+  if (label)
+    result = phase_unwrap_2D_tiled(ctx, wrapped, unwrapped, mask, label,
+                                   n_pe, n_fe, tile_size);
+
+  if (label) munmap(label, image_size * sizeof(int));
+  if (unwrapped) munmap(unwrapped, image_size * sizeof(float));
+  if (mask) munmap(mask, image_size);
+  if (wrapped) munmap(wrapped, image_size * sizeof(float));
+  if (unwrapped_name != NULL)
+  {
+    if (result && rename(unwrapped_name, unwrapped_file) != 0) result = 0;
+    if (!result) unlink(unwrapped_name);
+    free(unwrapped_name);
+  }
+  return result;
+}
+
+//No. of bytes the tiles being unwrapped at once need, besides the images,
+//the label map and the edges between tiles
+size_t unwrap_tiled_workspace_size(int tile_size, int n_threads)
+{
+  int halo_size = tile_size + 2;
+  size_t per_tile = compact_workspace_size(halo_size, halo_size, 0) +
+                    (size_t) halo_size * halo_size *
+                    (2 * sizeof(float) + 1 + sizeof(int)) +
+                    4 * (size_t) tile_size * sizeof(int);
+
+  if (n_threads <= 0) n_threads = unwrap_default_threads();
+  return per_tile * n_threads;
+}
@@ -0,0 +1,16 @@
+#ifndef __UNWRAP_TILED
+#define __UNWRAP_TILED
+
+#include "Munther_2D_unwrap.h"
+
+int phase_unwrap_2D_tiled(UNWRAP_CONTEXT *ctx, float* WrappedImage,
+                          float* UnwrappedImage, BYTE* input_mask,
+                          int* label_map, long n_pe, long n_fe,
+                          int tile_size);
+int phase_unwrap_2D_tiled_files(UNWRAP_CONTEXT *ctx, const char *wrapped_file,
+                                const char *unwrapped_file,
+                                const char *mask_file, long n_pe, long n_fe,
+                                int tile_size);
+size_t unwrap_tiled_workspace_size(int tile_size, int n_threads);
+
+#endif